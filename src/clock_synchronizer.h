@@ -0,0 +1,201 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _CLOCK_SYNCHRONIZER_H
+#define _CLOCK_SYNCHRONIZER_H
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+namespace duo3d_driver
+{
+// Device time covered by one hull point
+const double CLOCK_SYNC_BUCKET = 0.5;
+// Window length needed before the clock rate is estimated
+const double CLOCK_SYNC_MIN_RATE_SPAN = 10.0;
+// Largest accepted clock rate difference
+const double CLOCK_SYNC_MAX_SKEW = 1e-3;
+// Prediction error treated as a clock reset
+const double CLOCK_SYNC_MAX_ERROR = 1.0;
+// Weight of a new frame in the latency statistics
+const double CLOCK_SYNC_LATENCY_ALPHA = 0.02;
+
+// Maps the DUO device clock (100 us ticks) onto the host clock.
+// Every frame gives a point (device time, host arrival time). The arrival is
+// taken when the frame reaches the driver callback, so it is delayed by the
+// transport and, with Dense3D processing on, by the processing time. That
+// delay is never negative, so the device clock lies on the lower convex hull
+// of the points. The line used for the
+// stamps is the hull edge above the mean device time of the window: it lies
+// below all points and minimizes their total distance to it. Its slope
+// tracks the rate difference of the two clocks. The points are reduced to
+// the earliest arrival in each bucket of device time, so the hull stays
+// small over long windows.
+class ClockSynchronizer
+{
+    struct Point
+    {
+        double x, y;                    // Device and host time relative to the first frame
+    };
+
+    double _window;
+    double _min_latency;
+
+    bool _initialized;
+    int64_t _ticks;                     // Unwrapped ticks of the last frame
+    int64_t _base_ticks;
+    double _base_host;
+    std::deque<Point> _points;
+    std::vector<Point> _hull;
+
+    // Fitted line y = _offset + _rate * x
+    double _offset, _rate;
+
+    double _latency, _latency_mean, _latency_var;
+    uint32_t _frames;
+
+public:
+    ClockSynchronizer()
+        : _window(300.0),
+          _min_latency(0.0)
+    {
+        reset();
+    }
+
+    // 'window' is the time span in seconds the fit is based on.
+    // 'min_latency' is the known part of the capture to callback latency
+    // that can not be observed, it is subtracted from the stamps.
+    void configure(double window, double min_latency)
+    {
+        _window = std::max(window, CLOCK_SYNC_MIN_RATE_SPAN);
+        _min_latency = min_latency;
+    }
+    void reset()
+    {
+        _initialized = false;
+        _ticks = _base_ticks = 0;
+        _base_host = 0;
+        _points.clear();
+        _hull.clear();
+        _offset = 0;
+        _rate = 1;
+        _latency = _latency_mean = _latency_var = 0;
+        _frames = 0;
+    }
+
+    // Adds a frame with its device timestamp and host time in seconds at
+    // which it reached the callback
+    void addFrame(uint32_t ticks, double arrival)
+    {
+        if(_initialized && fabs(arrival - hostTime(ticks)) > CLOCK_SYNC_MAX_ERROR + _min_latency)
+            reset();
+        if(!_initialized)
+        {
+            _initialized = true;
+            _ticks = _base_ticks = ticks;
+            _base_host = arrival;
+        }
+        _ticks = unwrap(ticks);
+        Point p = { (_ticks - _base_ticks) * 1e-4, arrival - _base_host };
+
+        // Keep the earliest arrival of each bucket
+        if(!_points.empty() && floor(_points.back().x / CLOCK_SYNC_BUCKET) == floor(p.x / CLOCK_SYNC_BUCKET))
+        {
+            if(p.y - p.x < _points.back().y - _points.back().x) _points.back() = p;
+        }
+        else
+            _points.push_back(p);
+        while(_points.front().x < p.x - _window)
+            _points.pop_front();
+        fit();
+
+        double latency = arrival - hostTime(ticks);
+        if(_frames == 0)
+            _latency_mean = latency;
+        double delta = latency - _latency_mean;
+        _latency_mean += CLOCK_SYNC_LATENCY_ALPHA * delta;
+        _latency_var = (1 - CLOCK_SYNC_LATENCY_ALPHA) * (_latency_var + CLOCK_SYNC_LATENCY_ALPHA * delta * delta);
+        _latency = latency;
+        _frames++;
+    }
+
+    // Host time in seconds of device ticks close to the last frame
+    double hostTime(uint32_t ticks) const
+    {
+        double x = (unwrap(ticks) - _base_ticks) * 1e-4;
+        return _base_host + _offset + _rate * x - _min_latency;
+    }
+
+    // Capture to callback latency of the last frame: callback time minus stamp
+    double latency() const { return _latency; }
+    // Moving average and standard deviation of the latency
+    double latencyMean() const { return _latency_mean; }
+    double latencyJitter() const { return sqrt(_latency_var); }
+    // Rate of the device clock relative to the host clock minus one, in ppm.
+    // _rate is host seconds per device second, a fast device has _rate < 1.
+    double drift() const { return (1.0 / _rate - 1) * 1e6; }
+    uint32_t frames() const { return _frames; }
+
+private:
+    // Extends 32-bit ticks to the wrap-around closest to the last frame
+    int64_t unwrap(uint32_t ticks) const
+    {
+        return _ticks + (int32_t)(ticks - (uint32_t)_ticks);
+    }
+
+    void fit()
+    {
+        // Lower convex hull, the points are sorted by device time
+        _hull.clear();
+        double meanX = 0;
+        for(const Point &p : _points)
+        {
+            while(_hull.size() >= 2)
+            {
+                const Point &a = _hull[_hull.size() - 2], &b = _hull.back();
+                if((b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x) > 0) break;
+                _hull.pop_back();
+            }
+            _hull.push_back(p);
+            meanX += p.x;
+        }
+        meanX /= _points.size();
+
+        // Until the window is long enough only the offset is estimated
+        if(_points.back().x - _points.front().x < CLOCK_SYNC_MIN_RATE_SPAN)
+        {
+            _rate = 1;
+            _offset = _points.front().y - _points.front().x;
+            for(const Point &p : _points)
+                _offset = std::min(_offset, p.y - p.x);
+            return;
+        }
+        size_t k = 0;
+        while(k + 2 < _hull.size() && _hull[k + 1].x < meanX) k++;
+        const Point &a = _hull[k], &b = _hull[k + 1];
+        _rate = std::max(1 - CLOCK_SYNC_MAX_SKEW, std::min(1 + CLOCK_SYNC_MAX_SKEW, (b.y - a.y) / (b.x - a.x)));
+        _offset = a.y - _rate * a.x;
+    }
+};
+}
+
+#endif // _CLOCK_SYNCHRONIZER_H
@@ -0,0 +1,204 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _CONFIG_COMMITTER_H
+#define _CONFIG_COMMITTER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <ros/ros.h>
+
+namespace duo3d_driver
+{
+// Applies dynamic reconfigure updates on a dedicated control thread.
+// Updates arriving within the coalesce time are merged and applied once
+// with the newest values. The commit starts right after the frame being
+// processed has finished, so neither the reconfigure callback nor the
+// capture thread wait for the device calls. The apply function receives
+// the previously applied configuration to skip unchanged fields, and the
+// time from the request until the first frame processed with the new
+// values is reported.
+template<typename Config>
+class ConfigCommitter
+{
+public:
+    // 'previous' is NULL for the first configuration
+    typedef std::function<void(const Config &config, const Config *previous)> ApplyFunction;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    ApplyFunction _apply;
+    Clock::duration _coalesce;
+    Clock::duration _frame_timeout;
+
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _stop;
+
+    bool _initialized;
+    Config _previous;                   // Last applied configuration
+    bool _pending;
+    Config _config;                     // Newest requested configuration
+    int _updates;                       // Requests merged into the pending commit
+    Clock::time_point _requested;       // Time of the first of them
+
+    bool _in_frame;
+
+    // Latency of the last commit, reported by the next frame
+    bool _measuring;
+    int _measured_updates;
+    Clock::time_point _measured_requested, _measured_applied;
+
+public:
+    ConfigCommitter()
+        : _stop(false),
+          _initialized(false),
+          _pending(false),
+          _updates(0),
+          _in_frame(false),
+          _measuring(false),
+          _measured_updates(0)
+    {
+    }
+    ~ConfigCommitter()
+    {
+        stop();
+    }
+
+    // 'coalesce' is the time updates are collected before a commit and
+    // 'frame_timeout' the longest wait for the end of the current frame
+    void start(const ApplyFunction &apply, double coalesce, double frame_timeout)
+    {
+        _apply = apply;
+        _coalesce = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(coalesce));
+        _frame_timeout = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(frame_timeout));
+        _stop = false;
+        _thread = std::thread(&ConfigCommitter::controlLoop, this);
+    }
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        if(_thread.joinable()) _thread.join();
+    }
+
+    // Queues a configuration, called from the reconfigure callback.
+    // The first configuration is applied immediately on the calling thread
+    // so that the device is set up before streaming starts.
+    void post(const Config &config)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if(!_initialized)
+        {
+            _initialized = true;
+            _previous = config;
+            lock.unlock();
+            _apply(config, NULL);
+            return;
+        }
+        if(!_pending)
+        {
+            _pending = true;
+            _updates = 0;
+            _requested = Clock::now();
+        }
+        _config = config;
+        _updates++;
+        _wake.notify_all();
+    }
+
+    // Frame boundaries, called from the capture thread
+    void frameStarted()
+    {
+        bool report = false;
+        int updates = 0;
+        double applyMs = 0, effectiveMs = 0;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _in_frame = true;
+            if(_measuring)
+            {
+                Clock::time_point now = Clock::now();
+                report = true;
+                updates = _measured_updates;
+                applyMs = std::chrono::duration<double, std::milli>(_measured_applied - _measured_requested).count();
+                effectiveMs = std::chrono::duration<double, std::milli>(now - _measured_requested).count();
+                _measuring = false;
+            }
+        }
+        if(report)
+            ROS_DEBUG("Parameters applied %.1f ms and effective %.1f ms after the request (%d update%s merged)",
+                     applyMs, effectiveMs, updates, updates == 1 ? "" : "s");
+    }
+    void frameDone()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _in_frame = false;
+        }
+        _wake.notify_all();
+    }
+
+private:
+    void controlLoop()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for(;;)
+        {
+            _wake.wait(lock, [this]{ return _stop || _pending; });
+            if(_stop) return;
+
+            // Collect the updates of a slider drag into one commit
+            Clock::time_point deadline = _requested + _coalesce;
+            _wake.wait_until(lock, deadline, [this]{ return _stop; });
+            if(_stop) return;
+
+            // Commit between frames
+            _wake.wait_for(lock, _frame_timeout, [this]{ return _stop || !_in_frame; });
+            if(_stop) return;
+
+            Config config = _config, previous = _previous;
+            int updates = _updates;
+            Clock::time_point requested = _requested;
+            _previous = config;
+            _pending = false;
+            lock.unlock();
+
+            _apply(config, &previous);
+
+            lock.lock();
+            _measuring = true;
+            _measured_updates = updates;
+            _measured_requested = requested;
+            _measured_applied = Clock::now();
+        }
+    }
+};
+}
+
+#endif // _CONFIG_COMMITTER_H
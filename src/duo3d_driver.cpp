@@ -26,30 +26,56 @@
 #include <image_transport/image_transport.h>
 #include <sensor_msgs/Imu.h>
 #include <sensor_msgs/Temperature.h>
+#include <nav_msgs/OccupancyGrid.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 #include <cv_bridge/cv_bridge.h>
 #include <dynamic_reconfigure/server.h>
+#include <atomic>
+#include <mutex>
 
 // Config parameters
 #include <duo3d_driver/Duo3DConfig.h>
+// Messages and services
+#include <duo3d_driver/ClockSync.h>
+#include <duo3d_driver/Keypoints.h>
+#include <duo3d_driver/SaveSnapshot.h>
 
 // Include Dense3DMT
 #include <Dense3DMT.h>
 
+#include "clock_synchronizer.h"
+#include "config_committer.h"
+#include "depth.h"
+#include "feature_detector.h"
+#include "grid_mapper.h"
+#include "normal_estimator.h"
+#include "output_scheduler.h"
+#include "snapshot_buffer.h"
+#include "stereo_matcher.h"
+#include "temporal_filter.h"
+#include "thread_pool.h"
+
 using namespace std;
 using namespace cv;
 
 #define NODE_NAME   "duo3d"
 
+// Longest time in seconds between filtered frames the filter history is kept
+#define FILTER_MAX_GAP  1.0
+
 namespace duo3d_driver
 {
 // topic items
-enum { LEFT, RIGHT, RGB, DEPTH, POINT_CLOUD, IMU, TEMP, ITEM_COUNT };
+enum { LEFT, RIGHT, RGB, DEPTH, POINT_CLOUD, CONFIDENCE, NORMALS, GRID, GRID_HEIGHT,
+       LEFT_PYRAMID, RIGHT_PYRAMID, LEFT_KEYPOINTS, RIGHT_KEYPOINTS, IMU, TEMP, CLOCK_SYNC, ITEM_COUNT };
+// stereo engines
+enum { ENGINE_DENSE3D, ENGINE_BUILTIN };
 const vector<string> prefix =
 {
-    "left", "right", "rgb", "depth", "point_cloud", "imu", "temperature"
+    "left", "right", "rgb", "depth", "point_cloud", "confidence", "normals", "grid", "grid_height",
+    "left_pyramid", "right_pyramid", "left_keypoints", "right_keypoints", "imu", "temperature", "clock_sync"
 };
 
 // parameter names
@@ -60,8 +86,17 @@ const vector<string> topic_param_name =
     prefix[RGB] + "_topic",
     prefix[DEPTH] + "_topic",
     prefix[POINT_CLOUD] + "_topic",
+    prefix[CONFIDENCE] + "_topic",
+    prefix[NORMALS] + "_topic",
+    prefix[GRID] + "_topic",
+    prefix[GRID_HEIGHT] + "_topic",
+    prefix[LEFT_PYRAMID] + "_topic",
+    prefix[RIGHT_PYRAMID] + "_topic",
+    prefix[LEFT_KEYPOINTS] + "_topic",
+    prefix[RIGHT_KEYPOINTS] + "_topic",
     prefix[IMU] + "_topic",
-    prefix[TEMP] + "_topic"
+    prefix[TEMP] + "_topic",
+    prefix[CLOCK_SYNC] + "_topic"
 };
 const vector<string> cam_info_topic_param_name =
 {
@@ -77,8 +112,17 @@ const vector<string> frame_id_param_name =
     prefix[RGB] + "_frame_id",
     prefix[DEPTH] + "_frame_id",
     prefix[POINT_CLOUD] + "_frame_id",
+    prefix[CONFIDENCE] + "_frame_id",
+    prefix[NORMALS] + "_frame_id",
+    prefix[GRID] + "_frame_id",
+    prefix[GRID_HEIGHT] + "_frame_id",
+    prefix[LEFT_PYRAMID] + "_frame_id",
+    prefix[RIGHT_PYRAMID] + "_frame_id",
+    prefix[LEFT_KEYPOINTS] + "_frame_id",
+    prefix[RIGHT_KEYPOINTS] + "_frame_id",
     prefix[IMU] + "_frame_id",
-    prefix[TEMP] + "_frame_id"
+    prefix[TEMP] + "_frame_id",
+    prefix[CLOCK_SYNC] + "_frame_id"
 };
 
 // parameter default values
@@ -89,8 +133,17 @@ vector<string> topic_name =
     prefix[RGB] + "/image_rect",
     prefix[DEPTH] + "/image_raw",
     prefix[POINT_CLOUD] + "/image_raw",
+    prefix[CONFIDENCE] + "/image_raw",
+    prefix[NORMALS] + "/image_raw",
+    prefix[GRID] + "/occupancy",
+    prefix[GRID_HEIGHT] + "/image_raw",
+    prefix[LEFT] + "/pyramid",
+    prefix[RIGHT] + "/pyramid",
+    prefix[LEFT] + "/keypoints",
+    prefix[RIGHT] + "/keypoints",
     prefix[IMU] + "/data_raw",
-    prefix[TEMP]
+    prefix[TEMP],
+    prefix[CLOCK_SYNC]
 };
 vector<string> cam_info_topic_name =
 {
@@ -106,8 +159,17 @@ vector<string> frame_id_name =
     string(NODE_NAME) + "/camera_frame",      // RGB
     string(NODE_NAME) + "/camera_frame",      // DEPTH
     string(NODE_NAME) + "/camera_frame",      // POINT_CLOUD
+    string(NODE_NAME) + "/camera_frame",      // CONFIDENCE
+    string(NODE_NAME) + "/camera_frame",      // NORMALS
+    "odom",                                   // GRID
+    "odom",                                   // GRID_HEIGHT
+    string(NODE_NAME) + "/camera_frame",      // LEFT_PYRAMID
+    string(NODE_NAME) + "/camera_frame",      // RIGHT_PYRAMID
+    string(NODE_NAME) + "/camera_frame",      // LEFT_KEYPOINTS
+    string(NODE_NAME) + "/camera_frame",      // RIGHT_KEYPOINTS
     string(NODE_NAME) + "/imu_frame",         // IMU
-    string(NODE_NAME) + "/temperature_frame"  // TEMP
+    string(NODE_NAME) + "/temperature_frame", // TEMP
+    string(NODE_NAME) + "/camera_frame"       // CLOCK_SYNC
 };
 
 // DUO3DDriver class
@@ -119,17 +181,71 @@ class DUO3DDriver
     ros::NodeHandle _nh;
     // Dynamic reconfigure server
     dynamic_reconfigure::Server<Duo3DConfig> _server;
+    // Applies the reconfigured parameters between frames
+    ConfigCommitter<Duo3DConfig> _config_committer;
+    double _reconfigure_coalesce;
 
     // Camera Parameters
     float _frame_rate;
     vector<int> _image_size;
 
-    double _start_time;
+    // Device to host clock synchronization
+    ClockSynchronizer _clock_sync;
+    double _clock_sync_window;
+    double _min_transport_latency;
     uint32_t _frame_num;
 
+    // Output scheduling
+    OutputScheduler _scheduler;
+    std::mutex _scheduler_mutex;
+    bool _dense3d_enabled;
+    bool _depth_pending[ITEM_COUNT];
+    uint32_t _depth_wait_frames;
+
     // Dense3D
     Mat _colorLut;
 
+    // Worker threads for the per-pixel stages
+    int _worker_threads;
+    vector<int> _worker_cpus;
+    ThreadPool _pool;
+
+    // Snapshots of the last frames
+    int _snapshot_frames;
+    string _snapshot_directory;
+    SnapshotBuffer _snapshots;
+    SnapshotWriter _snapshot_writer;
+    ros::ServiceServer _srv_save_snapshot;
+
+    // Built-in stereo matcher
+    std::atomic<int> _stereo_engine;
+    StereoMatcher _matcher;
+    DUO_STEREO _stereo;
+    bool _stereo_valid;
+    vector<float> _disparity;
+    vector<Dense3DDepth> _depth;
+
+    // Temporal disparity filter
+    std::atomic<bool> _temporal_filter;
+    TemporalFilter _filter;
+    bool _filter_active;                // A frame has been filtered since the last reset
+    uint32_t _filter_ticks;             // Device time of that frame
+
+    // Surface normals
+    std::atomic<int> _normals_window;
+    NormalEstimator _normals;
+
+    // Robot centred height / occupancy grid
+    double _grid_size;
+    double _grid_resolution;
+    int _grid_point_stride;
+    GridMapper _grid_mapper;
+
+    // Image pyramids and keypoints for visual odometry
+    FeatureDetector _features;
+    ImagePyramid _pyramid;
+    KeypointList _keypoints;
+
     // Image publishers
     image_transport::Publisher _pub_image[ITEM_COUNT-1];
     // Camera info publishers
@@ -138,10 +254,16 @@ class DUO3DDriver
     sensor_msgs::CameraInfo _msg_cam_info[ITEM_COUNT-1];
     // Point cloud publisher
     ros::Publisher _pub_point_cloud;
+    // Occupancy grid publisher
+    ros::Publisher _pub_grid;
+    // Left and right keypoint publishers
+    ros::Publisher _pub_keypoints[2];
     // IMU publisher
     ros::Publisher _pub_imu;
     // Temperature publisher
     ros::Publisher _pub_temperature;
+    // Clock synchronization publisher
+    ros::Publisher _pub_clock_sync;
 
     // Gyroscope offset calibration
     int _num_samples;
@@ -152,34 +274,92 @@ public:
         : _dense3dInstance(NULL),
           _dense3d_license("XXXXX-XXXXX-XXXXX-XXXXX-XXXXX"),
           _nh(NODE_NAME),
+          _reconfigure_coalesce(0.05),
           _frame_rate(30),
-          _image_size({640, 480})
+          _image_size({640, 480}),
+          _clock_sync_window(300.0),
+          _min_transport_latency(0.0),
+          _scheduler(ITEM_COUNT),
+          _dense3d_enabled(true),
+          _depth_wait_frames(0),
+          _worker_threads(0),
+          _snapshot_frames(0),
+          _snapshot_directory("."),
+          _stereo_engine(ENGINE_DENSE3D),
+          _matcher(_pool),
+          _stereo_valid(false),
+          _temporal_filter(false),
+          _filter(_pool),
+          _filter_active(false),
+          _filter_ticks(0),
+          _normals_window(4),
+          _normals(_pool),
+          _grid_size(0),
+          _grid_resolution(0.05),
+          _grid_point_stride(2),
+          _features(_pool)
 	{
+        // Outputs that are spread over different frames when decimated
+        _scheduler.setExpensive(RGB, true);
+        _scheduler.setExpensive(DEPTH, true);
+        _scheduler.setExpensive(POINT_CLOUD, true);
+        _scheduler.setExpensive(CONFIDENCE, true);
+        _scheduler.setExpensive(NORMALS, true);
+        _scheduler.setExpensive(GRID, true);
+        _scheduler.setExpensive(LEFT_PYRAMID, true);
+
         // Build color lookup table for depth display
         _colorLut = Mat(Size(256, 1), CV_8UC3);
         for(int i = 0; i < 256; i++)
             _colorLut.at<Vec3b>(i) = (i==0) ? Vec3b(0, 0, 0) : HSV2RGB(i/256.0f, 1, 1);
 
+        std::fill(_depth_pending, _depth_pending + ITEM_COUNT, false);
+
         getParams();
 
+        for(int cpu : _pool.start(_worker_threads, _worker_cpus))
+            ROS_WARN("Could not pin worker threads to CPU %d, they run unpinned", cpu);
+        ROS_INFO("Using %d worker threads", _pool.size());
+        _snapshots.resize(_snapshot_frames);
+        _clock_sync.configure(_clock_sync_window, _min_transport_latency);
+
         image_transport::ImageTransport itrans(_nh);
         for(int i = 0; i < topic_name.size(); i++)
         {
             if(i == POINT_CLOUD)
                 _pub_point_cloud = _nh.advertise<sensor_msgs::PointCloud2>(topic_name[i], 16);
+            else if(i == GRID)
+                _pub_grid = _nh.advertise<nav_msgs::OccupancyGrid>(topic_name[i], 1);
+            else if(i == LEFT_KEYPOINTS || i == RIGHT_KEYPOINTS)
+                _pub_keypoints[i - LEFT_KEYPOINTS] = _nh.advertise<Keypoints>(topic_name[i], 16);
             else if(i == IMU)
                 _pub_imu = _nh.advertise<sensor_msgs::Imu>(topic_name[i], 100);
             else if(i == TEMP)
                 _pub_temperature = _nh.advertise<sensor_msgs::Temperature>(topic_name[i], 100);
+            else if(i == CLOCK_SYNC)
+                _pub_clock_sync = _nh.advertise<ClockSync>(topic_name[i], 16);
             else
                 _pub_image[i] = itrans.advertise(topic_name[i], 16);
         }
         for(int i = 0; i < cam_info_topic_name.size(); i++)
             _pub_cam_info[i] = _nh.advertise<sensor_msgs::CameraInfo>(cam_info_topic_name[i], 1);
+
+        if(_grid_size > 0 && !(_grid_resolution > 0))
+            ROS_ERROR("Invalid grid_resolution %g, the grid is disabled", _grid_resolution);
+        else if(_grid_size > 0)
+        {
+            if(ceil(_grid_size / _grid_resolution) > ROLLING_GRID_MAX_SIZE)
+                ROS_WARN("Grid of %g m at %g m resolution limited to %d cells per side",
+                         _grid_size, _grid_resolution, ROLLING_GRID_MAX_SIZE);
+            _grid_mapper.start(_grid_size, _grid_resolution, _grid_point_stride,
+                               frame_id_name[GRID], frame_id_name[GRID_HEIGHT], _pub_grid, _pub_image[GRID_HEIGHT]);
+        }
     }
     ~DUO3DDriver()
     {
         closeDense3D();
+        _grid_mapper.stop();
+        _pool.stop();
     }
 
     void run()
@@ -190,13 +370,24 @@ public:
 
             fillCameraInfo();
 
+            _snapshot_writer.start(_dense3dInstance);
+            _srv_save_snapshot = _nh.advertiseService("save_snapshot", &DUO3DDriver::saveSnapshotCallback, this);
+
+            // Wait at most two frame periods for the end of a frame before committing
+            _config_committer.start(boost::bind(&DUO3DDriver::applyConfig, this, _1, _2),
+                                    _reconfigure_coalesce, 2.0 / fps());
             _server.setCallback(boost::bind(&DUO3DDriver::dynamicCallback, this, _1, _2));
 
             _frame_num = 0;   // reset frame number
             _num_samples = 0;
+            _clock_sync.reset();
+            _dense3d_enabled = true;
+            std::fill(_depth_pending, _depth_pending + ITEM_COUNT, false);
+            _depth_wait_frames = 0;
+            _filter_active = false;
 
             if(!Dense3DStart(_dense3dInstance,
-                            [](const PDense3DFrame pFrame, void *pUserData)
+                            [](PDense3DFrame pFrame, void *pUserData)
                             {
                                 if(!ros::isShuttingDown())
                                     ((DUO3DDriver*)pUserData)->dense3dCallback(pFrame);
@@ -246,6 +437,16 @@ protected:
         nh.getParam("frame_rate", _frame_rate);
         nh.getParam("image_size", _image_size);
         nh.getParam("dense3d_license", _dense3d_license);
+        nh.getParam("reconfigure_coalesce", _reconfigure_coalesce);
+        nh.getParam("clock_sync_window", _clock_sync_window);
+        nh.getParam("min_transport_latency", _min_transport_latency);
+        nh.getParam("worker_threads", _worker_threads);
+        nh.getParam("worker_cpus", _worker_cpus);
+        nh.getParam("snapshot_frames", _snapshot_frames);
+        nh.getParam("snapshot_directory", _snapshot_directory);
+        nh.getParam("grid_size", _grid_size);
+        nh.getParam("grid_resolution", _grid_resolution);
+        nh.getParam("grid_point_stride", _grid_point_stride);
 
         for(int i = 0; i < topic_param_name.size(); i++)
             nh.getParam(topic_param_name[i], topic_name[i]);
@@ -257,20 +458,28 @@ protected:
 
     void dynamicCallback(Duo3DConfig &config, uint32_t level)
     {
+        _config_committer.post(config);
+    }
+
+    // Applies the fields of the configuration that differ from the previous one,
+    // called on the control thread between frames
+    void applyConfig(const Duo3DConfig &config, const Duo3DConfig *previous)
+    {
+#define CHANGED(field)  (!previous || config.field != previous->field)
         if(!_dense3dInstance) return;
         DUOInstance duo = GetDUOInstance(_dense3dInstance);
         // Set DUO parameters
         if(duo)
         {
-            SetDUOGain(duo, config.gain);
-            SetDUOExposure(duo, config.exposure);
-            SetDUOAutoExposure(duo, config.auto_exposure);
-            SetDUOCameraSwap(duo, config.camera_swap);
-            SetDUOHFlip(duo, config.horizontal_flip);
-            SetDUOVFlip(duo, config.vertical_flip);
-            SetDUOLedPWM(duo, config.led);
-            SetDUOIMURange(duo, config.accel_range, config.gyro_range);
-            SetDUOIMURate(duo, config.imu_rate);
+            if(CHANGED(gain)) SetDUOGain(duo, config.gain);
+            if(CHANGED(exposure)) SetDUOExposure(duo, config.exposure);
+            if(CHANGED(auto_exposure)) SetDUOAutoExposure(duo, config.auto_exposure);
+            if(CHANGED(camera_swap)) SetDUOCameraSwap(duo, config.camera_swap);
+            if(CHANGED(horizontal_flip)) SetDUOHFlip(duo, config.horizontal_flip);
+            if(CHANGED(vertical_flip)) SetDUOVFlip(duo, config.vertical_flip);
+            if(CHANGED(led)) SetDUOLedPWM(duo, config.led);
+            if(CHANGED(accel_range) || CHANGED(gyro_range)) SetDUOIMURange(duo, config.accel_range, config.gyro_range);
+            if(CHANGED(imu_rate)) SetDUOIMURate(duo, config.imu_rate);
         }
         // Set Dense3D parameters
         Dense3DParams params;
@@ -282,21 +491,268 @@ protected:
         params.uniqenessRatio = config.uniqueness_ratio;
         params.speckleWindowSize = config.speckle_window_size;
         params.speckleRange = config.speckle_range;
-        SetDense3Params(_dense3dInstance, params);
+        bool dense3dChanged = CHANGED(processing_mode) || CHANGED(image_scale) || CHANGED(num_disparities) ||
+                              CHANGED(sad_window_size) || CHANGED(pre_filter_cap) || CHANGED(uniqueness_ratio) ||
+                              CHANGED(speckle_window_size) || CHANGED(speckle_range);
+        if(dense3dChanged)
+            SetDense3Params(_dense3dInstance, params);
+
+        // Set built-in stereo matcher parameters
+        if(dense3dChanged || CHANGED(matching_cost) || CHANGED(sgm_p1) || CHANGED(sgm_p2) || CHANGED(lr_check))
+        {
+            StereoMatcherParams matcherParams;
+            matcherParams.fromDense3D(params);
+            matcherParams.cost = config.matching_cost;
+            matcherParams.p1 = config.sgm_p1;
+            matcherParams.p2 = config.sgm_p2;
+            matcherParams.lrCheck = config.lr_check;
+            _matcher.setParams(matcherParams);
+        }
+        if(config.stereo_engine != _stereo_engine)
+            ROS_INFO("Using %s stereo engine", config.stereo_engine == ENGINE_BUILTIN ? "built-in" : "Dense3D");
+        _stereo_engine = config.stereo_engine;
+
+        // Set temporal filter parameters, the history restarts with the new settings
+        if(CHANGED(filter_alpha) || CHANGED(filter_outlier_threshold) || CHANGED(filter_min_confidence))
+        {
+            TemporalFilterParams filterParams;
+            filterParams.alpha = config.filter_alpha;
+            filterParams.outlierThreshold = config.filter_outlier_threshold;
+            filterParams.minConfidence = config.filter_min_confidence;
+            _filter.setParams(filterParams);
+            _filter.reset();
+        }
+        // Do not resume from the history of before the filter was turned off
+        if(config.temporal_filter && !_temporal_filter)
+            _filter.reset();
+        _temporal_filter = config.temporal_filter;
+
+        _normals_window = config.normals_window;
+        if(CHANGED(grid_min_height) || CHANGED(grid_max_height))
+            _grid_mapper.setHeightBand(config.grid_min_height, config.grid_max_height);
+
+        if(CHANGED(pyramid_levels) || CHANGED(fast_threshold) || CHANGED(max_keypoints))
+        {
+            FeatureDetectorParams featureParams;
+            featureParams.levels = config.pyramid_levels;
+            featureParams.fastThreshold = config.fast_threshold;
+            featureParams.maxKeypoints = config.max_keypoints;
+            _features.setParams(featureParams);
+        }
+
+        // Set output scheduling
+        if(CHANGED(left_decimation) || CHANGED(right_decimation) || CHANGED(rgb_decimation) ||
+           CHANGED(depth_decimation) || CHANGED(point_cloud_decimation) || CHANGED(confidence_decimation) ||
+           CHANGED(normals_decimation) || CHANGED(grid_decimation) || CHANGED(features_decimation) ||
+           CHANGED(stagger_outputs))
+        {
+            std::lock_guard<std::mutex> lock(_scheduler_mutex);
+            _scheduler.setDecimation(LEFT, config.left_decimation);
+            _scheduler.setDecimation(RIGHT, config.right_decimation);
+            _scheduler.setDecimation(RGB, config.rgb_decimation);
+            _scheduler.setDecimation(DEPTH, config.depth_decimation);
+            _scheduler.setDecimation(POINT_CLOUD, config.point_cloud_decimation);
+            _scheduler.setDecimation(CONFIDENCE, config.confidence_decimation);
+            _scheduler.setDecimation(NORMALS, config.normals_decimation);
+            _scheduler.setDecimation(GRID, config.grid_decimation);
+            _scheduler.setDecimation(LEFT_PYRAMID, config.features_decimation);
+            _scheduler.setStagger(config.stagger_outputs);
+            _scheduler.reschedule();
+        }
+#undef CHANGED
     }
 
-    void dense3dCallback(const PDense3DFrame pFrame)
+    // Outputs computed together follow the schedule of one of them
+    static int scheduleItem(int item)
     {
-        bool needDense3d = (_pub_image[DEPTH].getNumSubscribers() > 0) ||
-                           (_pub_point_cloud.getNumSubscribers() > 0);
-        // Enable Dense3d processing
-        SetDense3DProcessing(_dense3dInstance, needDense3d);
+        if(item == GRID_HEIGHT) return GRID;
+        if(item >= LEFT_PYRAMID && item <= RIGHT_KEYPOINTS) return LEFT_PYRAMID;
+        return item;
+    }
+    // Returns true if the output is subscribed and scheduled for the given frame
+    bool outputActive(int item, uint32_t frame)
+    {
+        if(!_scheduler.due(scheduleItem(item), frame)) return false;
+        if(item == POINT_CLOUD) return _pub_point_cloud.getNumSubscribers() > 0;
+        if((item == GRID || item == GRID_HEIGHT) && !_grid_mapper.running()) return false;
+        if(item == GRID) return _pub_grid.getNumSubscribers() > 0;
+        if(item == LEFT_KEYPOINTS || item == RIGHT_KEYPOINTS) return _pub_keypoints[item - LEFT_KEYPOINTS].getNumSubscribers() > 0;
+        if(item == IMU) return _pub_imu.getNumSubscribers() > 0;
+        if(item == TEMP) return _pub_temperature.getNumSubscribers() > 0;
+        if(item == CLOCK_SYNC) return _pub_clock_sync.getNumSubscribers() > 0;
+        if(item == CONFIDENCE && !_temporal_filter) return false;
+        return _pub_image[item].getNumSubscribers() > 0;
+    }
+    // Returns true if the output is built from Dense3D data
+    static bool isDepthItem(int item)
+    {
+        return item == DEPTH || item == POINT_CLOUD || item == CONFIDENCE || item == NORMALS ||
+               item == GRID || item == GRID_HEIGHT;
+    }
+    // Returns true if any output of the given frame is built from Dense3D data
+    bool depthActive(uint32_t frame)
+    {
+        for(int i = 0; i < ITEM_COUNT; i++)
+            if(isDepthItem(i) && outputActive(i, frame)) return true;
+        return false;
+    }
 
-        // Set the start time
-        if(_frame_num++ == 0) _start_time = ros::Time::now().toSec();
+    bool saveSnapshotCallback(SaveSnapshot::Request &req, SaveSnapshot::Response &res)
+    {
+        res.frames = 0;
+        res.success = false;
+        uint8_t formats = SnapshotWriter::FORMAT_PLY | SnapshotWriter::FORMAT_PNG | SnapshotWriter::FORMAT_RAW;
+        if(!(req.formats & formats))
+        {
+            res.message = "No output format selected";
+            return true;
+        }
+
+        vector<SnapshotPtr> frames;
+        if(req.start.isZero() && req.end.isZero())
+        {
+            SnapshotPtr frame = _snapshots.frame(req.age);
+            if(frame) frames.push_back(frame);
+        }
+        else
+            frames = _snapshots.window(req.start, req.end);
+
+        string directory = req.directory.empty() ? _snapshot_directory : req.directory;
+        for(const SnapshotPtr &frame : frames)
+        {
+            if(!_snapshot_writer.write(frame, directory, req.formats & formats))
+            {
+                res.message = "Snapshot writer is not running";
+                return true;
+            }
+            res.frames++;
+        }
+
+        res.success = !frames.empty();
+        if(!_snapshots.enabled())
+            res.message = "Snapshot buffer is disabled, set ~snapshot_frames";
+        else if(frames.empty())
+            res.message = "No buffered frame matches the request";
+        return true;
+    }
+
+    void publishKeypoints(ros::Publisher &publisher, const std_msgs::Header &header)
+    {
+        Keypoints msg;
+        msg.header = header;
+        msg.level_start = _keypoints.levelStart;
+        size_t count = _keypoints.keypoints.size();
+        msg.x.resize(count);
+        msg.y.resize(count);
+        msg.score.resize(count);
+        for(size_t k = 0; k < count; k++)
+        {
+            msg.x[k] = _keypoints.keypoints[k].x;
+            msg.y[k] = _keypoints.keypoints[k].y;
+            msg.score[k] = _keypoints.keypoints[k].score;
+        }
+        publisher.publish(msg);
+    }
+
+    // Fills the disparity of the frame using the built-in matcher
+    void matchStereo(Dense3DFrame &frame)
+    {
+        int w = frame.duoFrame->width, h = frame.duoFrame->height;
+        _disparity.resize(w * h);
+        _matcher.compute(frame.duoFrame->leftData, frame.duoFrame->rightData, w, h, _disparity.data());
+        frame.disparityData = _disparity.data();
+    }
+    // Recomputes the depth of the frame from its disparity
+    void reprojectDepth(Dense3DFrame &frame)
+    {
+        int w = frame.duoFrame->width, h = frame.duoFrame->height;
+        _depth.resize(w * h);
+        _matcher.reproject(frame.disparityData, w, h, _stereo.Q, _depth.data());
+        frame.depthData = _depth.data();
+    }
+
+    void dense3dCallback(PDense3DFrame pFrame)
+    {
+        // Update the device to host clock mapping with the time the frame reached
+        // the callback, which is after Dense3D processing when that is on
+        _clock_sync.addFrame(pFrame->duoFrame->timeStamp, ros::Time::now().toSec());
+
+        _config_committer.frameStarted();
+
+        // Select the outputs produced for this frame. Depth outputs that were
+        // due on an earlier frame without Dense3D data are still pending.
+        bool active[ITEM_COUNT];
+        bool anyDepth = false;
+        bool nextDepth;
+        {
+            std::lock_guard<std::mutex> lock(_scheduler_mutex);
+            for(int i = 0; i < ITEM_COUNT; i++)
+            {
+                active[i] = outputActive(i, _frame_num) || _depth_pending[i];
+                if(isDepthItem(i) && active[i]) anyDepth = true;
+            }
+            _frame_num++;
+            nextDepth = depthActive(_frame_num);
+        }
 
         Size size(pFrame->duoFrame->width, pFrame->duoFrame->height);
 
+        // Replace the Dense3D results with the built-in matcher and/or filter them.
+        // The depth is then recomputed from the new disparity.
+        Dense3DFrame frame = *pFrame;
+        bool builtin = (_stereo_engine == ENGINE_BUILTIN);
+        if(builtin)
+        {
+            frame.dense3dDataValid = _stereo_valid && anyDepth;
+            if(frame.dense3dDataValid) matchStereo(frame);
+        }
+
+        // Dense3D processing is switched on one frame ahead of a due depth
+        // output, assuming SetDense3DProcessing applies to the next frame
+        // delivered. Dense3DMT is pipelined and may apply it later, so a due
+        // output that gets a frame without Dense3D data stays pending, and
+        // processing stays on, until the first valid frame arrives.
+        bool waiting = false;
+        for(int i = 0; i < ITEM_COUNT; i++)
+        {
+            if(!isDepthItem(i)) continue;
+            _depth_pending[i] = !builtin && active[i] && !frame.dense3dDataValid;
+            waiting = waiting || _depth_pending[i];
+        }
+        _depth_wait_frames = waiting ? _depth_wait_frames + 1 : 0;
+        if(_depth_wait_frames == 30)
+            ROS_WARN("No Dense3D data received for %u frames with depth outputs due", _depth_wait_frames);
+
+        // Enable Dense3d processing
+        bool needDense3d = !builtin && (nextDepth || waiting);
+        if(needDense3d != _dense3d_enabled)
+        {
+            SetDense3DProcessing(_dense3dInstance, needDense3d);
+            _dense3d_enabled = needDense3d;
+        }
+        bool filtered = _temporal_filter && _stereo_valid && frame.dense3dDataValid;
+        if(filtered)
+        {
+            // Drop a history too old to fill holes, e.g. after the depth outputs
+            // had no subscribers for a while
+            uint32_t ticks = frame.duoFrame->timeStamp;
+            if(_filter_active && (uint32_t)(ticks - _filter_ticks) > FILTER_MAX_GAP * 10000)
+                _filter.reset();
+            _filter_active = true;
+            _filter_ticks = ticks;
+            _filter.apply(frame.disparityData, size.width, size.height);
+        }
+        if(frame.dense3dDataValid && (builtin || filtered))
+            reprojectDepth(frame);
+        pFrame = &frame;
+
+        ros::Time stamp(_clock_sync.hostTime(pFrame->duoFrame->timeStamp));
+        if(_snapshot_frames > 0)
+        {
+            uint8_t source = (builtin ? Snapshot::DISPARITY_BUILTIN : 0) | (filtered ? Snapshot::DISPARITY_FILTERED : 0);
+            _snapshots.push(pFrame, source, _frame_num - 1, stamp);
+        }
+
         // Create Mat for left and right images
         Mat left(size, CV_8UC1, pFrame->duoFrame->leftData);
         Mat right(size, CV_8UC1, pFrame->duoFrame->rightData);
@@ -304,78 +760,89 @@ protected:
         for(int i = 0; i < ITEM_COUNT; i++)
         {
             std_msgs::Header header;
-            header.stamp = ros::Time(_start_time + (double)pFrame->duoFrame->timeStamp / 10000.0);
+            header.stamp = stamp;
             header.frame_id = frame_id_name[i];
 
-            if((i == LEFT) && (_pub_image[i].getNumSubscribers() > 0))
+            if((i == LEFT) && active[i])
             {
                 _pub_image[i].publish(cv_bridge::CvImage(header, sensor_msgs::image_encodings::MONO8, left).toImageMsg());
                 _msg_cam_info[i].header = header;
                 _pub_cam_info[i].publish(_msg_cam_info[i]);
             }
-            if((i == RIGHT) && (_pub_image[i].getNumSubscribers() > 0))
+            if((i == RIGHT) && active[i])
             {
                 _pub_image[i].publish(cv_bridge::CvImage(header, sensor_msgs::image_encodings::MONO8, right).toImageMsg());
                 _msg_cam_info[i].header = header;
                 _pub_cam_info[i].publish(_msg_cam_info[i]);
             }
-            if((i == RGB) && (_pub_image[i].getNumSubscribers() > 0))
+            if((i == RGB) && active[i])
             {
                 cv::Mat rgb(size, CV_8UC3);
-                uint8_t *src = left.data;
-                uint8_t *dst = rgb.data;
-                // Convert gray image to RGB
-                for(int j = 0; j < left.total(); j += 8)
-                {
-                    *dst++ = *src; *dst++ = *src; *dst++ = *src++;
-                    *dst++ = *src; *dst++ = *src; *dst++ = *src++;
-                    *dst++ = *src; *dst++ = *src; *dst++ = *src++;
-                    *dst++ = *src; *dst++ = *src; *dst++ = *src++;
-                    *dst++ = *src; *dst++ = *src; *dst++ = *src++;
-                    *dst++ = *src; *dst++ = *src; *dst++ = *src++;
-                    *dst++ = *src; *dst++ = *src; *dst++ = *src++;
-                    *dst++ = *src; *dst++ = *src; *dst++ = *src++;
-                }
+                grayToRGB(left, rgb);
                 _pub_image[i].publish(cv_bridge::CvImage(header, sensor_msgs::image_encodings::RGB8, rgb).toImageMsg());
                 _msg_cam_info[i].header = header;
                 _pub_cam_info[i].publish(_msg_cam_info[i]);
             }
-            if((i == DEPTH) && pFrame->dense3dDataValid)
+            if((i == DEPTH) && active[i] && pFrame->dense3dDataValid)
             {
-                Mat disp8;
-                Mat(size, CV_32FC1, pFrame->disparityData).convertTo(disp8, CV_8UC1, 255.0/(pFrame->dense3dParams.numDisparities*16.0));
-                Mat rgbDepth;
-                cvtColor(disp8, rgbDepth, cv::COLOR_GRAY2BGR);
-                LUT(rgbDepth, _colorLut, rgbDepth);
+                Mat rgbDepth(size, CV_8UC3);
+                colorizeDisparity(Mat(size, CV_32FC1, pFrame->disparityData), rgbDepth,
+                                  255.0f/(pFrame->dense3dParams.numDisparities*16.0f));
                 _pub_image[i].publish(cv_bridge::CvImage(header, sensor_msgs::image_encodings::RGB8, rgbDepth).toImageMsg());
                 _msg_cam_info[i].header = header;
                 _pub_cam_info[i].publish(_msg_cam_info[i]);
             }
-            if((i == POINT_CLOUD) && pFrame->dense3dDataValid)
+            if((i == POINT_CLOUD) && active[i] && pFrame->dense3dDataValid)
             {
                 Mat depth3d = Mat(size, CV_32FC3, pFrame->depthData);
                 pcl::PointCloud<pcl::PointXYZRGB> point_cloud;
-                point_cloud.width = width();
-                point_cloud.height = height();
-                uint8_t *color = left.data;
-                PDense3DDepth depth = (PDense3DDepth)depth3d.data;
-                for(int j = 0; j < left.total(); j++)
-                {
-                    if(depth[j].z >= 10000.0f) continue;
-                    pcl::PointXYZRGB p;
-                    p.x = depth[j].x * 0.001f;
-                    p.y = depth[j].y * 0.001f;
-                    p.z = depth[j].z * 0.001f;
-                    uint32_t rgb = ((uint32_t)color[j] << 16 | (uint32_t)color[j] << 8 | (uint32_t)color[j]);
-                    p.rgb = *reinterpret_cast<float*>(&rgb);
-                    point_cloud.push_back(p);
-                }
+                buildPointCloud(depth3d, left, point_cloud);
                 sensor_msgs::PointCloud2 output;
                 pcl::toROSMsg(point_cloud, output);
                 output.header = header;
                 _pub_point_cloud.publish(output);
             }
-            if((i == IMU) && pFrame->duoFrame->IMUPresent && (_pub_imu.getNumSubscribers() > 0))
+            if((i == CONFIDENCE) && active[i] && filtered)
+            {
+                Mat confidence;
+                Mat(size, CV_32FC1, (void*)_filter.confidence()).convertTo(confidence, CV_8UC1, 255.0);
+                _pub_image[i].publish(cv_bridge::CvImage(header, sensor_msgs::image_encodings::MONO8, confidence).toImageMsg());
+            }
+            if((i == NORMALS) && active[i] && pFrame->dense3dDataValid)
+            {
+                Mat normals(size, CV_32FC3);
+                _normals.compute(pFrame->depthData, size.width, size.height, _normals_window, (float*)normals.data);
+                _pub_image[i].publish(cv_bridge::CvImage(header, sensor_msgs::image_encodings::TYPE_32FC3, normals).toImageMsg());
+            }
+            // The grid is built and published by the mapper thread, the depth
+            // is posted with the camera frame it has to be transformed from
+            if((i == GRID) && (active[GRID] || active[GRID_HEIGHT]) && pFrame->dense3dDataValid)
+            {
+                header.frame_id = frame_id_name[DEPTH];
+                _grid_mapper.post(pFrame->depthData, size.width, size.height, header);
+            }
+            // The pyramid and keypoints of a camera are built from the same pyramid
+            if(i == LEFT_PYRAMID || i == RIGHT_PYRAMID)
+            {
+                int keypointsItem = (i == LEFT_PYRAMID) ? LEFT_KEYPOINTS : RIGHT_KEYPOINTS;
+                if(active[i] || active[keypointsItem])
+                {
+                    _features.buildPyramid(i == LEFT_PYRAMID ? pFrame->duoFrame->leftData : pFrame->duoFrame->rightData,
+                                           size.width, size.height, _pyramid);
+                    if(active[i])
+                    {
+                        Mat pyramid(_pyramid.height, _pyramid.width, CV_8UC1, _pyramid.data.data());
+                        _pub_image[i].publish(cv_bridge::CvImage(header, sensor_msgs::image_encodings::MONO8, pyramid).toImageMsg());
+                    }
+                    if(active[keypointsItem])
+                    {
+                        _features.detect(_pyramid, _keypoints);
+                        header.frame_id = frame_id_name[keypointsItem];
+                        publishKeypoints(_pub_keypoints[keypointsItem - LEFT_KEYPOINTS], header);
+                    }
+                }
+            }
+            if((i == IMU) && pFrame->duoFrame->IMUPresent && active[i])
             {
                 sensor_msgs::Imu imu_msg;
                 for(int j = 0; j < pFrame->duoFrame->IMUSamples; j++)
@@ -402,7 +869,7 @@ protected:
                     else
                     {
                         // Adjust timestamp
-                        header.stamp = ros::Time(_start_time + (double)pFrame->duoFrame->IMUData[j].timeStamp / 10000.0);
+                        header.stamp = ros::Time(_clock_sync.hostTime(pFrame->duoFrame->IMUData[j].timeStamp));
                         imu_msg.header = header;
                         // Accelerations should be in m/s^2
                         imu_msg.linear_acceleration.x = pFrame->duoFrame->IMUData[j].accelData[0] * 9.81;
@@ -417,18 +884,109 @@ protected:
                     if(_num_samples < 101) _num_samples++;
                 }
             }
-            if((i == TEMP) && pFrame->duoFrame->IMUPresent && (_pub_temperature.getNumSubscribers() > 0))
+            if((i == TEMP) && pFrame->duoFrame->IMUPresent && active[i])
             {
                 sensor_msgs::Temperature temp_msg;
                 for(int j = 0; j < pFrame->duoFrame->IMUSamples; j++)
                 {
-                    header.stamp = ros::Time(_start_time + (double)pFrame->duoFrame->IMUData[j].timeStamp / 10000.0);
+                    header.stamp = ros::Time(_clock_sync.hostTime(pFrame->duoFrame->IMUData[j].timeStamp));
                     temp_msg.header = header;
                     temp_msg.temperature = pFrame->duoFrame->IMUData[j].tempData;
                     _pub_temperature.publish(temp_msg);
                 }
             }
+            if((i == CLOCK_SYNC) && active[i])
+            {
+                ClockSync sync_msg;
+                sync_msg.header = header;
+                sync_msg.latency = _clock_sync.latency();
+                sync_msg.latency_mean = _clock_sync.latencyMean();
+                sync_msg.latency_jitter = _clock_sync.latencyJitter();
+                sync_msg.drift = _clock_sync.drift();
+                _pub_clock_sync.publish(sync_msg);
+            }
         }
+        _config_committer.frameDone();
+    }
+
+    // Expands a gray image to RGB
+    void grayToRGB(const Mat &gray, Mat &rgb)
+    {
+        _pool.parallelRows(gray.rows, gray.cols, [&](int begin, int end, int)
+        {
+            for(int y = begin; y < end; y++)
+            {
+                const uint8_t *src = gray.ptr<uint8_t>(y);
+                uint8_t *dst = rgb.ptr<uint8_t>(y);
+                for(int x = 0; x < gray.cols; x++, dst += 3)
+                    dst[0] = dst[1] = dst[2] = src[x];
+            }
+        });
+    }
+
+    // Scales the disparity to [0, 255] and maps it through the color lookup table
+    void colorizeDisparity(const Mat &disparity, Mat &rgb, float scale)
+    {
+        const Vec3b *lut = _colorLut.ptr<Vec3b>();
+        _pool.parallelRows(disparity.rows, disparity.cols * sizeof(float), [&](int begin, int end, int)
+        {
+            for(int y = begin; y < end; y++)
+            {
+                const float *src = disparity.ptr<float>(y);
+                Vec3b *dst = rgb.ptr<Vec3b>(y);
+                for(int x = 0; x < disparity.cols; x++)
+                {
+                    // Saturate like convertTo, NaN maps to 0
+                    float v = src[x] * scale;
+                    int index = !(v > 0.0f) ? 0 : (v >= 255.0f) ? 255 : (int)lrintf(v);
+                    dst[x] = lut[index];
+                }
+            }
+        });
+    }
+
+    // Converts the valid Dense3D depth points to a colored point cloud in meters.
+    // Valid points are counted per band first, so every band writes its points
+    // at a fixed offset and the point order does not depend on the thread count.
+    // Both passes must use the same test, NaN depth is invalid in both.
+    void buildPointCloud(const Mat &depth3d, const Mat &gray, pcl::PointCloud<pcl::PointXYZRGB> &point_cloud)
+    {
+        int cols = depth3d.cols;
+        size_t rowBytes = cols * sizeof(Dense3DDepth);
+        int bandRows = ThreadPool::bandHeight(depth3d.rows, rowBytes);
+        int bands = (depth3d.rows + bandRows - 1) / bandRows;
+        const PDense3DDepth depth = (PDense3DDepth)depth3d.data;
+        const uint8_t *color = gray.data;
+
+        vector<size_t> offset(bands + 1, 0);
+        _pool.parallelRows(depth3d.rows, rowBytes, [&](int begin, int end, int band)
+        {
+            size_t count = 0;
+            for(int j = begin * cols; j < end * cols; j++)
+                if(depth[j].z < INVALID_DEPTH) count++;
+            offset[band + 1] = count;
+        });
+        for(int band = 0; band < bands; band++)
+            offset[band + 1] += offset[band];
+
+        point_cloud.points.resize(offset[bands]);
+        point_cloud.width = offset[bands];
+        point_cloud.height = 1;
+        point_cloud.is_dense = true;
+        _pool.parallelRows(depth3d.rows, rowBytes, [&](int begin, int end, int band)
+        {
+            pcl::PointXYZRGB *p = point_cloud.points.data() + offset[band];
+            for(int j = begin * cols; j < end * cols; j++)
+            {
+                if(!(depth[j].z < INVALID_DEPTH)) continue;
+                p->x = depth[j].x * 0.001f;
+                p->y = depth[j].y * 0.001f;
+                p->z = depth[j].z * 0.001f;
+                uint32_t rgb = ((uint32_t)color[j] << 16 | (uint32_t)color[j] << 8 | (uint32_t)color[j]);
+                p->rgb = *reinterpret_cast<float*>(&rgb);
+                p++;
+            }
+        });
     }
 
     bool fillCameraInfo()
@@ -436,12 +994,13 @@ protected:
         if(!_dense3dInstance) return false;
         DUOInstance duo = GetDUOInstance(_dense3dInstance);
         if(!duo) return false;
-        DUO_STEREO stereo;
+        DUO_STEREO &stereo = _stereo;
         if(!GetDUOStereoParameters(duo, &stereo))
         {
             ROS_ERROR("Could not get DUO camera calibration data");
             return false;
         }
+        _stereo_valid = true;
         for(int i = 0; i < ITEM_COUNT-1; i++)
         {
             _msg_cam_info[i].width = width();
@@ -492,6 +1051,7 @@ protected:
         }
         if(!SetDense3DLicense(_dense3dInstance, _dense3d_license.c_str()))
         {
+            // Capture and rectification go through Dense3D, the built-in engine needs the license too
             ROS_ERROR("Invalid or missing Dense3D license. To get your license visit https://duo3d.com/account");
             return false;
         }
@@ -508,6 +1068,8 @@ protected:
         if(_dense3dInstance)
         {
             Dense3DStop(_dense3dInstance);
+            _config_committer.stop();
+            _snapshot_writer.stop();
             Dense3DClose(_dense3dInstance);
             _dense3dInstance = NULL;
         }
@@ -0,0 +1,289 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#include "feature_detector.h"
+
+#include <string.h>
+#include <algorithm>
+#include <limits>
+
+#include "simd.h"
+
+namespace duo3d_driver
+{
+namespace
+{
+using namespace simd;
+
+// Smallest pyramid level that is still built
+const int MIN_LEVEL_SIZE = 16;
+// FAST circle radius plus the gradient reach of the 7x7 Harris window
+const int BORDER = 4;
+// Score of pixels that are not FAST corners
+const float NO_CORNER = std::numeric_limits<float>::lowest();
+
+// Bresenham circle of radius 3, clockwise from the top
+const int CIRCLE[16][2] =
+{
+    {0, -3}, {1, -3}, {2, -2}, {3, -1}, {3, 0}, {3, 1}, {2, 2}, {1, 3},
+    {0, 3}, {-1, 3}, {-2, 2}, {-3, 1}, {-3, 0}, {-3, -1}, {-2, -2}, {-1, -3}
+};
+
+inline int clamp(int v, int lo, int hi) { return std::max(lo, std::min(v, hi)); }
+
+// Marks the pixels of a row that may be FAST-9 corners with a value > 0.
+// Any arc of 9 circle pixels contains two neighbouring compass pixels
+// (top, right, bottom, left), so both of them must be brighter or darker.
+void screenRow(const uint8_t *p, int stride, int width, int threshold, int16_t *candidate)
+{
+    vec t = vset(threshold);
+    int x = BORDER;
+    for(; x + LANES + 3 <= width; x += LANES)
+    {
+        vec c = vloadu8(p + x);
+        vec top = vloadu8(p - 3 * stride + x);
+        vec right = vloadu8(p + x + 3);
+        vec bottom = vloadu8(p + 3 * stride + x);
+        vec left = vloadu8(p + x - 3);
+        vec bright = vadd(c, t), dark = vsub(c, t);
+        vec b0 = vsub(top, bright), b1 = vsub(right, bright), b2 = vsub(bottom, bright), b3 = vsub(left, bright);
+        vec d0 = vsub(dark, top), d1 = vsub(dark, right), d2 = vsub(dark, bottom), d3 = vsub(dark, left);
+        vec brighter = vmax(vmax(vmin(b0, b1), vmin(b1, b2)), vmax(vmin(b2, b3), vmin(b3, b0)));
+        vec darker = vmax(vmax(vmin(d0, d1), vmin(d1, d2)), vmax(vmin(d2, d3), vmin(d3, d0)));
+        vstore(candidate + x, vmax(brighter, darker));
+    }
+    for(; x < width - BORDER; x++)
+        candidate[x] = 1;
+}
+
+// Full FAST-9 segment test: 9 contiguous circle pixels brighter or darker
+inline bool segmentTest(const uint8_t *p, const int *circle, int threshold)
+{
+    int bright = p[0] + threshold, dark = p[0] - threshold;
+    int brightRun = 0, darkRun = 0;
+    for(int i = 0; i < 16 + 8; i++)
+    {
+        int v = p[circle[i & 15]];
+        if(v > bright)
+        {
+            darkRun = 0;
+            if(++brightRun >= 9) return true;
+        }
+        else if(v < dark)
+        {
+            brightRun = 0;
+            if(++darkRun >= 9) return true;
+        }
+        else
+            brightRun = darkRun = 0;
+    }
+    return false;
+}
+
+// Harris response of the structure tensor over a 7x7 window
+inline float harrisResponse(const uint8_t *p, int stride)
+{
+    int a = 0, b = 0, c = 0;
+    for(int dy = -3; dy <= 3; dy++)
+    {
+        const uint8_t *q = p + dy * stride;
+        for(int dx = -3; dx <= 3; dx++)
+        {
+            int ix = q[dx + 1] - q[dx - 1];
+            int iy = q[dx + stride] - q[dx - stride];
+            a += ix * ix;
+            b += iy * iy;
+            c += ix * iy;
+        }
+    }
+    float fa = a, fb = b, fc = c;
+    return fa * fb - fc * fc - 0.04f * (fa + fb) * (fa + fb);
+}
+
+// Strongest first, ties broken by position to keep the output deterministic
+inline bool stronger(const Keypoint &a, const Keypoint &b)
+{
+    if(a.score != b.score) return a.score > b.score;
+    if(a.y != b.y) return a.y < b.y;
+    return a.x < b.x;
+}
+}
+
+void FeatureDetector::setParams(const FeatureDetectorParams &params)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _params = params;
+}
+
+FeatureDetectorParams FeatureDetector::params()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _params;
+}
+
+void FeatureDetector::buildPyramid(const uint8_t *image, int width, int height, ImagePyramid &pyramid)
+{
+    FeatureDetectorParams params = this->params();
+
+    // Level layout, the packed image is only cleared when the layout changes
+    std::vector<ImagePyramid::Level> levels(1, ImagePyramid::Level{0, 0, width, height});
+    int y = 0;
+    for(int i = 1; i < params.levels; i++)
+    {
+        const ImagePyramid::Level &prev = levels.back();
+        ImagePyramid::Level level = {width, y, (prev.width + 1) / 2, (prev.height + 1) / 2};
+        if(level.width < MIN_LEVEL_SIZE || level.height < MIN_LEVEL_SIZE) break;
+        levels.push_back(level);
+        y += level.height;
+    }
+    int packedWidth = width + (levels.size() > 1 ? levels[1].width : 0);
+    int packedHeight = std::max(height, y);
+    if(packedWidth != pyramid.width || packedHeight != pyramid.height || levels.size() != pyramid.levels.size())
+    {
+        pyramid.width = packedWidth;
+        pyramid.height = packedHeight;
+        pyramid.data.assign((size_t)packedWidth * packedHeight, 0);
+    }
+    pyramid.levels = levels;
+
+    uint8_t *base = pyramid.level(0);
+    _pool.parallelRows(height, width, [&](int begin, int end, int)
+    {
+        for(int v = begin; v < end; v++)
+            memcpy(base + (size_t)v * pyramid.width, image + (size_t)v * width, width);
+    });
+    for(size_t i = 1; i < levels.size(); i++)
+        downsample(pyramid.level(i - 1), levels[i - 1].width, levels[i - 1].height,
+                   pyramid.level(i), levels[i].width, levels[i].height, pyramid.width);
+}
+
+void FeatureDetector::downsample(const uint8_t *src, int srcWidth, int srcHeight, uint8_t *dst, int dstWidth, int dstHeight, int stride)
+{
+    _pool.parallelRows(dstHeight, srcWidth * 2, [&](int begin, int end, int)
+    {
+        // Vertically filtered source row with two replicated pixels on each side
+        std::vector<int16_t> buffer(srcWidth + 4);
+        int16_t *row = buffer.data() + 2;
+        for(int y = begin; y < end; y++)
+        {
+            // 1 4 6 4 1 binomial filter, vertical pass
+            const uint8_t *r[5];
+            for(int k = 0; k < 5; k++)
+                r[k] = src + (size_t)clamp(2 * y - 2 + k, 0, srcHeight - 1) * stride;
+            int x = 0;
+            for(; x + LANES <= srcWidth; x += LANES)
+            {
+                vec center = vloadu8(r[2] + x);
+                vec outer = vadd(vloadu8(r[0] + x), vloadu8(r[4] + x));
+                vec inner = vadd(vadd(vloadu8(r[1] + x), vloadu8(r[3] + x)), center);
+                inner = vadd(inner, inner);
+                inner = vadd(inner, inner);
+                vstore(row + x, vadd(vadd(outer, inner), vadd(center, center)));
+            }
+            for(; x < srcWidth; x++)
+                row[x] = r[0][x] + r[4][x] + 4 * (r[1][x] + r[3][x]) + 6 * r[2][x];
+            row[-2] = row[-1] = row[0];
+            row[srcWidth] = row[srcWidth + 1] = row[srcWidth - 1];
+
+            // Horizontal pass on the even columns
+            uint8_t *out = dst + (size_t)y * stride;
+            for(int x = 0; x < dstWidth; x++)
+            {
+                const int16_t *p = row + 2 * x;
+                out[x] = (uint8_t)((p[-2] + p[2] + 4 * (p[-1] + p[1]) + 6 * p[0] + 128) >> 8);
+            }
+        }
+    });
+}
+
+void FeatureDetector::detect(const ImagePyramid &pyramid, KeypointList &list)
+{
+    FeatureDetectorParams params = this->params();
+    list.keypoints.clear();
+    list.levelStart.assign(1, 0);
+    std::vector<Keypoint> keypoints;
+    for(size_t i = 0; i < pyramid.levels.size(); i++)
+    {
+        const ImagePyramid::Level &level = pyramid.levels[i];
+        detectLevel(pyramid.level(i), level.width, level.height, pyramid.width,
+                    params.fastThreshold, params.maxKeypoints, keypoints);
+        list.keypoints.insert(list.keypoints.end(), keypoints.begin(), keypoints.end());
+        list.levelStart.push_back(list.keypoints.size());
+    }
+}
+
+void FeatureDetector::detectLevel(const uint8_t *image, int width, int height, int stride, int threshold, int maxKeypoints,
+                                  std::vector<Keypoint> &keypoints)
+{
+    keypoints.clear();
+    if(width <= 2 * BORDER || height <= 2 * BORDER) return;
+
+    int circle[16];
+    for(int i = 0; i < 16; i++)
+        circle[i] = CIRCLE[i][1] * stride + CIRCLE[i][0];
+
+    // Harris response of the pixels passing the segment test
+    _scores.resize((size_t)width * height);
+    _pool.parallelRows(height, width, [&](int begin, int end, int)
+    {
+        std::vector<int16_t> candidate(width);
+        for(int y = begin; y < end; y++)
+        {
+            float *score = &_scores[(size_t)y * width];
+            std::fill(score, score + width, NO_CORNER);
+            if(y < BORDER || y >= height - BORDER) continue;
+            const uint8_t *p = image + (size_t)y * stride;
+            screenRow(p, stride, width, threshold, candidate.data());
+            for(int x = BORDER; x < width - BORDER; x++)
+                if(candidate[x] > 0 && segmentTest(p + x, circle, threshold))
+                    score[x] = harrisResponse(p + x, stride);
+        }
+    });
+
+    // 3x3 non-maximum suppression, equal neighbours keep the first in raster order
+    int bandRows = ThreadPool::bandHeight(height, width * sizeof(float));
+    std::vector<std::vector<Keypoint>> bands((height + bandRows - 1) / bandRows);
+    _pool.parallelRows(height, width * sizeof(float), [&](int begin, int end, int band)
+    {
+        std::vector<Keypoint> &found = bands[band];
+        for(int y = std::max(begin, BORDER); y < std::min(end, height - BORDER); y++)
+        {
+            const float *s = &_scores[(size_t)y * width];
+            const float *above = s - width, *below = s + width;
+            for(int x = BORDER; x < width - BORDER; x++)
+            {
+                float v = s[x];
+                if(v == NO_CORNER) continue;
+                if(v > above[x - 1] && v > above[x] && v > above[x + 1] && v > s[x - 1] &&
+                   v >= s[x + 1] && v >= below[x - 1] && v >= below[x] && v >= below[x + 1])
+                    found.push_back(Keypoint{(uint16_t)x, (uint16_t)y, v});
+            }
+        }
+    });
+    for(const std::vector<Keypoint> &found : bands)
+        keypoints.insert(keypoints.end(), found.begin(), found.end());
+
+    if(maxKeypoints > 0 && (int)keypoints.size() > maxKeypoints)
+    {
+        std::nth_element(keypoints.begin(), keypoints.begin() + maxKeypoints, keypoints.end(), stronger);
+        keypoints.resize(maxKeypoints);
+    }
+    std::sort(keypoints.begin(), keypoints.end(), stronger);
+}
+}
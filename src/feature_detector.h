@@ -0,0 +1,117 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _FEATURE_DETECTOR_H
+#define _FEATURE_DETECTOR_H
+
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace duo3d_driver
+{
+struct FeatureDetectorParams
+{
+    int levels;                         // Number of pyramid levels including the full resolution image
+    int fastThreshold;                  // FAST intensity threshold
+    int maxKeypoints;                   // Keypoints kept per level, strongest Harris response first
+
+    FeatureDetectorParams()
+        : levels(4),
+          fastThreshold(20),
+          maxKeypoints(500)
+    {
+    }
+};
+
+// Pyramid levels packed into one image: the full resolution level on the
+// left, the smaller levels stacked top to bottom on its right
+struct ImagePyramid
+{
+    struct Level
+    {
+        int x, y;                       // Position in the packed image
+        int width, height;
+    };
+    int width, height;                  // Size of the packed image
+    std::vector<uint8_t> data;
+    std::vector<Level> levels;
+
+    ImagePyramid()
+        : width(0),
+          height(0)
+    {
+    }
+    const uint8_t *level(int i) const { return data.data() + (size_t)levels[i].y * width + levels[i].x; }
+    uint8_t *level(int i) { return data.data() + (size_t)levels[i].y * width + levels[i].x; }
+};
+
+struct Keypoint
+{
+    uint16_t x, y;                      // Position in level pixels
+    float score;                        // Harris corner response
+};
+
+// Keypoints of all levels, level i holds [levelStart[i], levelStart[i + 1])
+struct KeypointList
+{
+    std::vector<Keypoint> keypoints;
+    std::vector<uint32_t> levelStart;
+};
+
+// Image pyramid and FAST-9 corner detector for visual odometry front-ends.
+// Levels are built with a 5x5 binomial filter and decimated by two. On each
+// level the corner candidates are screened with a vectorized test of the four
+// compass pixels, confirmed with the full segment test, scored with the
+// Harris response and thinned by 3x3 non-maximum suppression. Rows are
+// processed in bands on the pool, the results do not depend on the number
+// of threads.
+class FeatureDetector
+{
+    ThreadPool &_pool;
+    std::mutex _mutex;
+    FeatureDetectorParams _params;
+
+    std::vector<float> _scores;         // Harris response of the FAST corners of a level
+
+public:
+    FeatureDetector(ThreadPool &pool)
+        : _pool(pool)
+    {
+    }
+
+    void setParams(const FeatureDetectorParams &params);
+    FeatureDetectorParams params();
+
+    // Builds the pyramid of a grayscale image
+    void buildPyramid(const uint8_t *image, int width, int height, ImagePyramid &pyramid);
+
+    // Detects the keypoints on every level of the pyramid
+    void detect(const ImagePyramid &pyramid, KeypointList &list);
+
+private:
+    void downsample(const uint8_t *src, int srcWidth, int srcHeight, uint8_t *dst, int dstWidth, int dstHeight, int stride);
+    void detectLevel(const uint8_t *image, int width, int height, int stride, int threshold, int maxKeypoints,
+                     std::vector<Keypoint> &keypoints);
+};
+}
+
+#endif // _FEATURE_DETECTOR_H
@@ -0,0 +1,226 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _GRID_MAPPER_H
+#define _GRID_MAPPER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ros/ros.h>
+#include <image_transport/image_transport.h>
+#include <sensor_msgs/image_encodings.h>
+#include <nav_msgs/OccupancyGrid.h>
+#include <tf2_ros/buffer.h>
+#include <tf2_ros/transform_listener.h>
+#include <cv_bridge/cv_bridge.h>
+
+#include <Dense3DMT.h>
+
+#include "depth.h"
+#include "rolling_grid.h"
+
+namespace duo3d_driver
+{
+// Builds the robot centred height / occupancy grid on its own thread.
+// The capture thread posts a subsampled copy of the valid depth points and
+// returns, the worker transforms them into the grid frame, scatters them
+// into the rolling grid and publishes it. If the worker is still busy when
+// the next frame arrives, the older pending frame is dropped.
+class GridMapper
+{
+    RollingGrid _grid;
+    std::string _grid_frame;
+    std::string _height_frame;
+    int _stride;
+    double _min_height, _max_height;
+
+    ros::Publisher _pub_occupancy;
+    image_transport::Publisher _pub_height;
+    tf2_ros::Buffer _tf_buffer;
+    std::unique_ptr<tf2_ros::TransformListener> _tf_listener;
+
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _stop;
+    bool _pending;
+    std::vector<Dense3DDepth> _points, _work;
+    std_msgs::Header _header;
+
+public:
+    GridMapper()
+        : _stride(2),
+          _min_height(0.05),
+          _max_height(1.5),
+          _stop(false),
+          _pending(false)
+    {
+    }
+    ~GridMapper()
+    {
+        stop();
+    }
+
+    bool running() const { return _thread.joinable(); }
+
+    // The occupancy grid is built in 'grid_frame', the height image is
+    // stamped with 'height_frame' which should be the same or aligned with it
+    void start(double size, double resolution, int stride,
+               const std::string &grid_frame, const std::string &height_frame,
+               const ros::Publisher &occupancy, const image_transport::Publisher &height)
+    {
+        _grid.configure(size, resolution);
+        _stride = std::max(stride, 1);
+        _grid_frame = grid_frame;
+        _height_frame = height_frame;
+        _pub_occupancy = occupancy;
+        _pub_height = height;
+        _tf_listener.reset(new tf2_ros::TransformListener(_tf_buffer));
+        _stop = false;
+        _thread = std::thread(&GridMapper::workerLoop, this);
+    }
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        if(_thread.joinable()) _thread.join();
+    }
+
+    void setHeightBand(double min_height, double max_height)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _min_height = min_height;
+        _max_height = max_height;
+    }
+
+    // Queues the depth of a frame, header.frame_id is the depth frame
+    void post(const Dense3DDepth *depth, int width, int height, const std_msgs::Header &header)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _points.clear();
+        for(int v = 0; v < height; v += _stride)
+        {
+            const Dense3DDepth *row = depth + (size_t)v * width;
+            for(int u = 0; u < width; u += _stride)
+                if(row[u].z < INVALID_DEPTH) _points.push_back(row[u]);
+        }
+        _header = header;
+        _pending = true;
+        _wake.notify_one();
+    }
+
+private:
+    void workerLoop()
+    {
+        for(;;)
+        {
+            std_msgs::Header header;
+            double min_height, max_height;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [this]{ return _stop || _pending; });
+                if(_stop) return;
+                _points.swap(_work);
+                header = _header;
+                min_height = _min_height;
+                max_height = _max_height;
+                _pending = false;
+            }
+
+            geometry_msgs::TransformStamped transform;
+            try
+            {
+                transform = _tf_buffer.lookupTransform(_grid_frame, header.frame_id, header.stamp, ros::Duration(0.1));
+            }
+            catch(tf2::TransformException &e)
+            {
+                ROS_WARN_THROTTLE(5.0, "Grid: %s", e.what());
+                continue;
+            }
+            integrate(transform, min_height, max_height);
+            publish(header.stamp);
+        }
+    }
+
+    void integrate(const geometry_msgs::TransformStamped &transform, double min_height, double max_height)
+    {
+        const geometry_msgs::Vector3 &t = transform.transform.translation;
+        const geometry_msgs::Quaternion &q = transform.transform.rotation;
+        // Rotation matrix of the depth frame in the grid frame
+        double r[9] =
+        {
+            1 - 2 * (q.y * q.y + q.z * q.z), 2 * (q.x * q.y - q.z * q.w),     2 * (q.x * q.z + q.y * q.w),
+            2 * (q.x * q.y + q.z * q.w),     1 - 2 * (q.x * q.x + q.z * q.z), 2 * (q.y * q.z - q.x * q.w),
+            2 * (q.x * q.z - q.y * q.w),     2 * (q.y * q.z + q.x * q.w),     1 - 2 * (q.x * q.x + q.y * q.y)
+        };
+        _grid.recenter(t.x, t.y);
+        _grid.beginFrame();
+        for(const Dense3DDepth &p : _work)
+        {
+            // Dense3D depth is in millimeters
+            double x = p.x * 0.001, y = p.y * 0.001, z = p.z * 0.001;
+            _grid.insert(r[0] * x + r[1] * y + r[2] * z + t.x,
+                         r[3] * x + r[4] * y + r[5] * z + t.y,
+                         r[6] * x + r[7] * y + r[8] * z + t.z,
+                         min_height, max_height);
+        }
+    }
+
+    void publish(const ros::Time &stamp)
+    {
+        std_msgs::Header header;
+        header.stamp = stamp;
+        int size = _grid.size();
+        if(_pub_occupancy.getNumSubscribers() > 0)
+        {
+            nav_msgs::OccupancyGrid msg;
+            header.frame_id = _grid_frame;
+            msg.header = header;
+            msg.info.map_load_time = header.stamp;
+            msg.info.resolution = _grid.resolution();
+            msg.info.width = size;
+            msg.info.height = size;
+            msg.info.origin.position.x = _grid.originX();
+            msg.info.origin.position.y = _grid.originY();
+            msg.info.origin.orientation.w = 1.0;
+            msg.data.resize((size_t)size * size);
+            _grid.exportOccupancy(&msg.data[0]);
+            _pub_occupancy.publish(msg);
+        }
+        if(_pub_height.getNumSubscribers() > 0)
+        {
+            cv::Mat height(size, size, CV_32FC1);
+            _grid.exportHeight((float*)height.data);
+            header.frame_id = _height_frame;
+            _pub_height.publish(cv_bridge::CvImage(header, sensor_msgs::image_encodings::TYPE_32FC1, height).toImageMsg());
+        }
+    }
+};
+}
+
+#endif // _GRID_MAPPER_H
@@ -0,0 +1,136 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#include "normal_estimator.h"
+
+#include <math.h>
+#include <algorithm>
+#include <limits>
+
+#include "depth.h"
+#include "simd.h"
+
+namespace duo3d_driver
+{
+using namespace simd;
+
+void NormalEstimator::buildIntegral(const Dense3DDepth *depth, int width, int height)
+{
+    size_t stride = (size_t)(width + 1) * 4;
+    _integral.resize((height + 1) * stride);
+    std::fill(_integral.begin(), _integral.begin() + stride, 0.0);
+
+    // Row prefix sums of the valid points in meters
+    _pool.parallelRows(height, width * sizeof(Dense3DDepth), [&](int begin, int end, int)
+    {
+        for(int v = begin; v < end; v++)
+        {
+            const Dense3DDepth *p = depth + (size_t)v * width;
+            double *row = &_integral[(v + 1) * stride];
+            std::fill(row, row + 4, 0.0);
+            for(int u = 0; u < width; u++)
+            {
+                double *cell = row + (u + 1) * 4;
+                if(p[u].z < INVALID_DEPTH)
+                {
+                    double point[4] = { p[u].x * 0.001, p[u].y * 0.001, p[u].z * 0.001, 1.0 };
+                    vstore4d(cell, vadd4d(vload4d(cell - 4), vload4d(point)));
+                }
+                else
+                    vstore4d(cell, vload4d(cell - 4));
+            }
+        }
+    });
+
+    // Column prefix sums, sequential along the columns of each strip
+    const int strip = 64;
+    _pool.parallelFor((width + strip) / strip, [&](int index)
+    {
+        size_t u0 = (size_t)index * strip, u1 = std::min<size_t>(width + 1, u0 + strip);
+        for(int v = 1; v <= height; v++)
+        {
+            double *row = &_integral[v * stride];
+            const double *above = row - stride;
+            for(size_t u = u0; u < u1; u++)
+                vstore4d(row + u * 4, vadd4d(vload4d(row + u * 4), vload4d(above + u * 4)));
+        }
+    });
+}
+
+void NormalEstimator::compute(const Dense3DDepth *depth, int width, int height, int radius, float *normals)
+{
+    buildIntegral(depth, width, height);
+
+    size_t stride = (size_t)(width + 1) * 4;
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    // Sum of (x, y, z, count) over the inclusive rectangle, clipped to the image
+    auto rect = [&](int u0, int v0, int u1, int v1, double *sum)
+    {
+        u0 = std::max(u0, 0); v0 = std::max(v0, 0);
+        u1 = std::min(u1, width - 1); v1 = std::min(v1, height - 1);
+        if(u0 > u1 || v0 > v1)
+        {
+            std::fill(sum, sum + 4, 0.0);
+            return;
+        }
+        const double *top = &_integral[v0 * stride], *bottom = &_integral[(v1 + 1) * stride];
+        vec4d s = vsub4d(vadd4d(vload4d(bottom + (u1 + 1) * 4), vload4d(top + u0 * 4)),
+                         vadd4d(vload4d(top + (u1 + 1) * 4), vload4d(bottom + u0 * 4)));
+        vstore4d(sum, s);
+    };
+
+    _pool.parallelRows(height, width * 3 * sizeof(float), [&](int begin, int end, int)
+    {
+        for(int v = begin; v < end; v++)
+        {
+            for(int u = 0; u < width; u++)
+            {
+                const Dense3DDepth &p = depth[(size_t)v * width + u];
+                float *n = normals + ((size_t)v * width + u) * 3;
+                n[0] = n[1] = n[2] = nan;
+                if(p.z >= INVALID_DEPTH) continue;
+
+                double l[4], r[4], t[4], b[4];
+                rect(u - radius, v - radius, u - 1, v + radius, l);
+                rect(u + 1, v - radius, u + radius, v + radius, r);
+                rect(u - radius, v - radius, u + radius, v - 1, t);
+                rect(u - radius, v + 1, u + radius, v + radius, b);
+                if(l[3] == 0 || r[3] == 0 || t[3] == 0 || b[3] == 0) continue;
+
+                double dx[3], dy[3];
+                for(int k = 0; k < 3; k++)
+                {
+                    dx[k] = r[k] / r[3] - l[k] / l[3];
+                    dy[k] = b[k] / b[3] - t[k] / t[3];
+                }
+                double nx = dx[1] * dy[2] - dx[2] * dy[1];
+                double ny = dx[2] * dy[0] - dx[0] * dy[2];
+                double nz = dx[0] * dy[1] - dx[1] * dy[0];
+                double length = sqrt(nx * nx + ny * ny + nz * nz);
+                if(length < 1e-12) continue;
+                // Face the camera at the origin
+                if(nx * p.x + ny * p.y + nz * p.z > 0) length = -length;
+                n[0] = nx / length;
+                n[1] = ny / length;
+                n[2] = nz / length;
+            }
+        }
+    });
+}
+}
@@ -0,0 +1,57 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _NORMAL_ESTIMATOR_H
+#define _NORMAL_ESTIMATOR_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <Dense3DMT.h>
+
+#include "thread_pool.h"
+
+namespace duo3d_driver
+{
+// Surface normals of the organized Dense3D depth grid.
+// Builds an integral image of the valid points and takes the normal as the
+// cross product of the horizontal and vertical 3D gradients, each being
+// the difference of the mean points of the two half windows around the
+// pixel. The cost per pixel is independent of the window size.
+class NormalEstimator
+{
+    ThreadPool &_pool;
+    std::vector<double> _integral;      // (H + 1) x (W + 1) x (x, y, z, count)
+
+public:
+    NormalEstimator(ThreadPool &pool)
+        : _pool(pool)
+    {
+    }
+
+    // Computes unit normals facing the camera as (nx, ny, nz) per pixel.
+    // Pixels without depth or enough valid neighbours get NaN.
+    void compute(const Dense3DDepth *depth, int width, int height, int radius, float *normals);
+
+private:
+    void buildIntegral(const Dense3DDepth *depth, int width, int height);
+};
+}
+
+#endif // _NORMAL_ESTIMATOR_H
@@ -0,0 +1,121 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _OUTPUT_SCHEDULER_H
+#define _OUTPUT_SCHEDULER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+namespace duo3d_driver
+{
+// Decides on which frames each output is produced.
+// Every output is published once every 'decimation' frames. Outputs marked
+// as expensive get a phase offset so that their work is spread over
+// different frames instead of piling up on the same one.
+class OutputScheduler
+{
+    // Upper bound for the scheduling window used to balance the phases
+    enum { MAX_WINDOW = 3600 };
+
+    std::vector<int> _decimation;
+    std::vector<int> _phase;
+    std::vector<bool> _expensive;
+    bool _stagger;
+
+public:
+    OutputScheduler(int count)
+        : _decimation(count, 1),
+          _phase(count, 0),
+          _expensive(count, false),
+          _stagger(true)
+    {
+    }
+
+    void setExpensive(int item, bool expensive) { _expensive[item] = expensive; }
+    void setDecimation(int item, int decimation) { _decimation[item] = std::max(decimation, 1); }
+    void setStagger(bool stagger) { _stagger = stagger; }
+
+    // Returns true if the item has to be produced for the given frame
+    bool due(int item, uint32_t frame) const
+    {
+        return (frame % _decimation[item]) == (uint32_t)_phase[item];
+    }
+
+    // Recomputes the phase offsets of the expensive outputs.
+    // Must be called after changing the decimation or stagger settings.
+    void reschedule()
+    {
+        std::fill(_phase.begin(), _phase.end(), 0);
+        if(!_stagger) return;
+
+        // Balance over the least common multiple of all expensive periods
+        std::vector<int> items;
+        int window = 1;
+        for(int i = 0; i < _decimation.size(); i++)
+        {
+            if(!_expensive[i] || _decimation[i] == 1) continue;
+            items.push_back(i);
+            window = std::min(lcm(window, _decimation[i]), (int)MAX_WINDOW);
+        }
+        // Place the most frequent outputs first, they have the fewest choices
+        std::stable_sort(items.begin(), items.end(), [this](int a, int b)
+        {
+            return _decimation[a] < _decimation[b];
+        });
+
+        // Frames where an expensive output runs on every frame are loaded anyway
+        int base = 0;
+        for(int i = 0; i < _decimation.size(); i++)
+            if(_expensive[i] && _decimation[i] == 1) base++;
+        std::vector<int> load(window, base);
+
+        for(int item : items)
+        {
+            int period = _decimation[item];
+            int best_phase = 0, best_peak = 0, best_sum = 0;
+            for(int phase = 0; phase < period; phase++)
+            {
+                int peak = 0, sum = 0;
+                for(int f = phase; f < window; f += period)
+                {
+                    peak = std::max(peak, load[f]);
+                    sum += load[f];
+                }
+                if(phase == 0 || peak < best_peak || (peak == best_peak && sum < best_sum))
+                {
+                    best_phase = phase;
+                    best_peak = peak;
+                    best_sum = sum;
+                }
+            }
+            _phase[item] = best_phase;
+            for(int f = best_phase; f < window; f += period)
+                load[f]++;
+        }
+    }
+
+private:
+    static int gcd(int a, int b) { return b == 0 ? a : gcd(b, a % b); }
+    static int lcm(int a, int b) { return a / gcd(a, b) * b; }
+};
+}
+
+#endif // _OUTPUT_SCHEDULER_H
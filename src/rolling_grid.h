@@ -0,0 +1,170 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _ROLLING_GRID_H
+#define _ROLLING_GRID_H
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace duo3d_driver
+{
+// Largest number of cells per grid side
+const int ROLLING_GRID_MAX_SIZE = 2048;
+
+// Fixed size 2.5D grid that follows the robot.
+// World cell (cx, cy) is stored at ring index (cx mod N, cy mod N), so
+// moving the window only clears the rows and columns that enter it and
+// never moves or reallocates the cell data.
+class RollingGrid
+{
+public:
+    enum { UNKNOWN = -1, FREE = 0, OCCUPIED = 100 };
+
+private:
+    struct Cell
+    {
+        int8_t state;
+        float height;                   // Highest point seen in the cell
+        uint32_t frame;                 // Frame of the last observation
+    };
+
+    int _size;
+    double _resolution;
+    std::vector<Cell> _cells;
+    int64_t _minX, _minY;               // World cell index of the window corner
+    bool _placed;
+    uint32_t _frame;
+
+public:
+    RollingGrid()
+        : _size(0),
+          _resolution(0.05),
+          _minX(0),
+          _minY(0),
+          _placed(false),
+          _frame(0)
+    {
+    }
+
+    // 'resolution' must be positive, the side is limited to ROLLING_GRID_MAX_SIZE cells
+    void configure(double size, double resolution)
+    {
+        _resolution = resolution;
+        _size = (int)std::max(1.0, std::min((double)ROLLING_GRID_MAX_SIZE, ceil(size / resolution)));
+        _cells.resize((size_t)_size * _size);
+        clear();
+    }
+    void clear()
+    {
+        for(Cell &cell : _cells) reset(cell);
+        _placed = false;
+    }
+
+    int size() const { return _size; }
+    double resolution() const { return _resolution; }
+    // World position of the window corner
+    double originX() const { return _minX * _resolution; }
+    double originY() const { return _minY * _resolution; }
+
+    // Moves the window so that it is centred on (x, y)
+    void recenter(double x, double y)
+    {
+        int64_t minX = (int64_t)floor(x / _resolution) - _size / 2;
+        int64_t minY = (int64_t)floor(y / _resolution) - _size / 2;
+        int64_t dx = minX - _minX, dy = minY - _minY;
+        if(!_placed || std::abs(dx) >= _size || std::abs(dy) >= _size)
+        {
+            for(Cell &cell : _cells) reset(cell);
+        }
+        else
+        {
+            // Clear the columns and rows scrolling into the window
+            for(int64_t cx = std::min(_minX, minX) + (dx > 0 ? _size : 0), n = 0; n < std::abs(dx); cx++, n++)
+                for(int r = 0; r < _size; r++)
+                    reset(_cells[(size_t)r * _size + ring(cx)]);
+            for(int64_t cy = std::min(_minY, minY) + (dy > 0 ? _size : 0), n = 0; n < std::abs(dy); cy++, n++)
+                for(int c = 0; c < _size; c++)
+                    reset(_cells[(size_t)ring(cy) * _size + c]);
+        }
+        _minX = minX;
+        _minY = minY;
+        _placed = true;
+    }
+
+    // Starts a new observation, cells seen again replace their previous state
+    void beginFrame()
+    {
+        if(++_frame == 0) _frame = 1;
+    }
+
+    // Adds a point in world coordinates. Points below minHeight are ground,
+    // points up to maxHeight are obstacles and points above are ignored.
+    void insert(double x, double y, double z, double minHeight, double maxHeight)
+    {
+        if(z > maxHeight) return;
+        int64_t cx = (int64_t)floor(x / _resolution) - _minX;
+        int64_t cy = (int64_t)floor(y / _resolution) - _minY;
+        if(cx < 0 || cy < 0 || cx >= _size || cy >= _size) return;
+
+        Cell &cell = _cells[(size_t)ring(cy + _minY) * _size + ring(cx + _minX)];
+        int8_t state = (z < minHeight) ? FREE : OCCUPIED;
+        if(cell.frame != _frame)
+        {
+            cell.frame = _frame;
+            cell.state = state;
+            cell.height = z;
+        }
+        else
+        {
+            cell.state = std::max(cell.state, state);
+            cell.height = std::max(cell.height, (float)z);
+        }
+    }
+
+    // Copies the window in row-major order starting at the window corner
+    void exportOccupancy(int8_t *data) const
+    {
+        for(int r = 0; r < _size; r++)
+            for(int c = 0; c < _size; c++)
+                data[(size_t)r * _size + c] = at(r, c).state;
+    }
+    void exportHeight(float *data) const
+    {
+        for(int r = 0; r < _size; r++)
+            for(int c = 0; c < _size; c++)
+                data[(size_t)r * _size + c] = at(r, c).height;
+    }
+
+private:
+    size_t ring(int64_t cell) const { return (size_t)(((cell % _size) + _size) % _size); }
+    const Cell &at(int r, int c) const { return _cells[ring(_minY + r) * _size + ring(_minX + c)]; }
+    static void reset(Cell &cell)
+    {
+        cell.state = UNKNOWN;
+        cell.height = std::numeric_limits<float>::quiet_NaN();
+        cell.frame = 0;
+    }
+};
+}
+
+#endif // _ROLLING_GRID_H
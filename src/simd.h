@@ -0,0 +1,215 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace duo3d_driver
+{
+// Thin wrappers over the AVX2, SSE2 and NEON intrinsics with a scalar
+// fallback. The instruction set is selected at compile time.
+namespace simd
+{
+// Vector of signed 16-bit lanes
+#if defined(__AVX2__)
+typedef __m256i vec;
+enum { LANES = 16 };
+static const char *const SIMD_NAME = "AVX2";
+static inline vec vload(const int16_t *p) { return _mm256_loadu_si256((const __m256i*)p); }
+static inline vec vloadu8(const uint8_t *p) { return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p)); }
+static inline void vstore(int16_t *p, vec v) { _mm256_storeu_si256((__m256i*)p, v); }
+static inline vec vset(int16_t x) { return _mm256_set1_epi16(x); }
+static inline vec vadd(vec a, vec b) { return _mm256_add_epi16(a, b); }
+static inline vec vadds(vec a, vec b) { return _mm256_adds_epi16(a, b); }
+static inline vec vsub(vec a, vec b) { return _mm256_sub_epi16(a, b); }
+static inline vec vmin(vec a, vec b) { return _mm256_min_epi16(a, b); }
+static inline vec vmax(vec a, vec b) { return _mm256_max_epi16(a, b); }
+static inline int16_t vhmin(vec v)
+{
+    __m128i m = _mm_min_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    m = _mm_min_epi16(m, _mm_srli_si128(m, 8));
+    m = _mm_min_epi16(m, _mm_srli_si128(m, 4));
+    m = _mm_min_epi16(m, _mm_srli_si128(m, 2));
+    return (int16_t)_mm_cvtsi128_si32(m);
+}
+#elif defined(__SSE2__)
+typedef __m128i vec;
+enum { LANES = 8 };
+static const char *const SIMD_NAME = "SSE2";
+static inline vec vload(const int16_t *p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline vec vloadu8(const uint8_t *p) { return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128()); }
+static inline void vstore(int16_t *p, vec v) { _mm_storeu_si128((__m128i*)p, v); }
+static inline vec vset(int16_t x) { return _mm_set1_epi16(x); }
+static inline vec vadd(vec a, vec b) { return _mm_add_epi16(a, b); }
+static inline vec vadds(vec a, vec b) { return _mm_adds_epi16(a, b); }
+static inline vec vsub(vec a, vec b) { return _mm_sub_epi16(a, b); }
+static inline vec vmin(vec a, vec b) { return _mm_min_epi16(a, b); }
+static inline vec vmax(vec a, vec b) { return _mm_max_epi16(a, b); }
+static inline int16_t vhmin(vec m)
+{
+    m = _mm_min_epi16(m, _mm_srli_si128(m, 8));
+    m = _mm_min_epi16(m, _mm_srli_si128(m, 4));
+    m = _mm_min_epi16(m, _mm_srli_si128(m, 2));
+    return (int16_t)_mm_cvtsi128_si32(m);
+}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+typedef int16x8_t vec;
+enum { LANES = 8 };
+static const char *const SIMD_NAME = "NEON";
+static inline vec vload(const int16_t *p) { return vld1q_s16(p); }
+static inline vec vloadu8(const uint8_t *p) { return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p))); }
+static inline void vstore(int16_t *p, vec v) { vst1q_s16(p, v); }
+static inline vec vset(int16_t x) { return vdupq_n_s16(x); }
+static inline vec vadd(vec a, vec b) { return vaddq_s16(a, b); }
+static inline vec vadds(vec a, vec b) { return vqaddq_s16(a, b); }
+static inline vec vsub(vec a, vec b) { return vsubq_s16(a, b); }
+static inline vec vmin(vec a, vec b) { return vminq_s16(a, b); }
+static inline vec vmax(vec a, vec b) { return vmaxq_s16(a, b); }
+static inline int16_t vhmin(vec v)
+{
+    int16x4_t m = vmin_s16(vget_low_s16(v), vget_high_s16(v));
+    m = vpmin_s16(m, m);
+    m = vpmin_s16(m, m);
+    return vget_lane_s16(m, 0);
+}
+#else
+typedef int16_t vec;
+enum { LANES = 1 };
+static const char *const SIMD_NAME = "none";
+static inline vec vload(const int16_t *p) { return *p; }
+static inline vec vloadu8(const uint8_t *p) { return *p; }
+static inline void vstore(int16_t *p, vec v) { *p = v; }
+static inline vec vset(int16_t x) { return x; }
+static inline vec vadd(vec a, vec b) { return a + b; }
+static inline vec vadds(vec a, vec b) { return (int16_t)std::min(a + b, 32767); }
+static inline vec vsub(vec a, vec b) { return a - b; }
+static inline vec vmin(vec a, vec b) { return std::min(a, b); }
+static inline vec vmax(vec a, vec b) { return std::max(a, b); }
+static inline int16_t vhmin(vec v) { return v; }
+#endif
+
+// Vector of float lanes and the matching comparison mask
+#if defined(__AVX2__)
+typedef __m256 vecf;
+typedef __m256 maskf;
+enum { LANESF = 8 };
+static inline vecf vloadf(const float *p) { return _mm256_loadu_ps(p); }
+static inline void vstoref(float *p, vecf v) { _mm256_storeu_ps(p, v); }
+static inline vecf vsetf(float x) { return _mm256_set1_ps(x); }
+static inline vecf vaddf(vecf a, vecf b) { return _mm256_add_ps(a, b); }
+static inline vecf vsubf(vecf a, vecf b) { return _mm256_sub_ps(a, b); }
+static inline vecf vmulf(vecf a, vecf b) { return _mm256_mul_ps(a, b); }
+static inline vecf vminf(vecf a, vecf b) { return _mm256_min_ps(a, b); }
+static inline vecf vabsf(vecf a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+static inline maskf vgtf(vecf a, vecf b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+static inline maskf vlef(vecf a, vecf b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static inline maskf vandm(maskf a, maskf b) { return _mm256_and_ps(a, b); }
+static inline maskf vandnotm(maskf a, maskf b) { return _mm256_andnot_ps(a, b); }
+static inline maskf vorm(maskf a, maskf b) { return _mm256_or_ps(a, b); }
+static inline vecf vselectf(maskf m, vecf a, vecf b) { return _mm256_blendv_ps(b, a, m); }
+#elif defined(__SSE2__)
+typedef __m128 vecf;
+typedef __m128 maskf;
+enum { LANESF = 4 };
+static inline vecf vloadf(const float *p) { return _mm_loadu_ps(p); }
+static inline void vstoref(float *p, vecf v) { _mm_storeu_ps(p, v); }
+static inline vecf vsetf(float x) { return _mm_set1_ps(x); }
+static inline vecf vaddf(vecf a, vecf b) { return _mm_add_ps(a, b); }
+static inline vecf vsubf(vecf a, vecf b) { return _mm_sub_ps(a, b); }
+static inline vecf vmulf(vecf a, vecf b) { return _mm_mul_ps(a, b); }
+static inline vecf vminf(vecf a, vecf b) { return _mm_min_ps(a, b); }
+static inline vecf vabsf(vecf a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+static inline maskf vgtf(vecf a, vecf b) { return _mm_cmpgt_ps(a, b); }
+static inline maskf vlef(vecf a, vecf b) { return _mm_cmple_ps(a, b); }
+static inline maskf vandm(maskf a, maskf b) { return _mm_and_ps(a, b); }
+static inline maskf vandnotm(maskf a, maskf b) { return _mm_andnot_ps(a, b); }
+static inline maskf vorm(maskf a, maskf b) { return _mm_or_ps(a, b); }
+static inline vecf vselectf(maskf m, vecf a, vecf b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+typedef float32x4_t vecf;
+typedef uint32x4_t maskf;
+enum { LANESF = 4 };
+static inline vecf vloadf(const float *p) { return vld1q_f32(p); }
+static inline void vstoref(float *p, vecf v) { vst1q_f32(p, v); }
+static inline vecf vsetf(float x) { return vdupq_n_f32(x); }
+static inline vecf vaddf(vecf a, vecf b) { return vaddq_f32(a, b); }
+static inline vecf vsubf(vecf a, vecf b) { return vsubq_f32(a, b); }
+static inline vecf vmulf(vecf a, vecf b) { return vmulq_f32(a, b); }
+static inline vecf vminf(vecf a, vecf b) { return vminq_f32(a, b); }
+static inline vecf vabsf(vecf a) { return vabsq_f32(a); }
+static inline maskf vgtf(vecf a, vecf b) { return vcgtq_f32(a, b); }
+static inline maskf vlef(vecf a, vecf b) { return vcleq_f32(a, b); }
+static inline maskf vandm(maskf a, maskf b) { return vandq_u32(a, b); }
+static inline maskf vandnotm(maskf a, maskf b) { return vbicq_u32(b, a); }
+static inline maskf vorm(maskf a, maskf b) { return vorrq_u32(a, b); }
+static inline vecf vselectf(maskf m, vecf a, vecf b) { return vbslq_f32(m, a, b); }
+#else
+typedef float vecf;
+typedef bool maskf;
+enum { LANESF = 1 };
+static inline vecf vloadf(const float *p) { return *p; }
+static inline void vstoref(float *p, vecf v) { *p = v; }
+static inline vecf vsetf(float x) { return x; }
+static inline vecf vaddf(vecf a, vecf b) { return a + b; }
+static inline vecf vsubf(vecf a, vecf b) { return a - b; }
+static inline vecf vmulf(vecf a, vecf b) { return a * b; }
+static inline vecf vminf(vecf a, vecf b) { return std::min(a, b); }
+static inline vecf vabsf(vecf a) { return fabsf(a); }
+static inline maskf vgtf(vecf a, vecf b) { return a > b; }
+static inline maskf vlef(vecf a, vecf b) { return a <= b; }
+static inline maskf vandm(maskf a, maskf b) { return a && b; }
+static inline maskf vandnotm(maskf a, maskf b) { return !a && b; }
+static inline maskf vorm(maskf a, maskf b) { return a || b; }
+static inline vecf vselectf(maskf m, vecf a, vecf b) { return m ? a : b; }
+#endif
+
+// Four doubles, used for (x, y, z, count) integral image entries
+#if defined(__AVX2__)
+typedef __m256d vec4d;
+static inline vec4d vload4d(const double *p) { return _mm256_loadu_pd(p); }
+static inline void vstore4d(double *p, vec4d v) { _mm256_storeu_pd(p, v); }
+static inline vec4d vadd4d(vec4d a, vec4d b) { return _mm256_add_pd(a, b); }
+static inline vec4d vsub4d(vec4d a, vec4d b) { return _mm256_sub_pd(a, b); }
+#elif defined(__SSE2__)
+struct vec4d { __m128d lo, hi; };
+static inline vec4d vload4d(const double *p) { return { _mm_loadu_pd(p), _mm_loadu_pd(p + 2) }; }
+static inline void vstore4d(double *p, vec4d v) { _mm_storeu_pd(p, v.lo); _mm_storeu_pd(p + 2, v.hi); }
+static inline vec4d vadd4d(vec4d a, vec4d b) { return { _mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi) }; }
+static inline vec4d vsub4d(vec4d a, vec4d b) { return { _mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi) }; }
+#else
+struct vec4d { double v[4]; };
+static inline vec4d vload4d(const double *p) { return { { p[0], p[1], p[2], p[3] } }; }
+static inline void vstore4d(double *p, vec4d v) { std::copy(v.v, v.v + 4, p); }
+static inline vec4d vadd4d(vec4d a, vec4d b) { return { { a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3] } }; }
+static inline vec4d vsub4d(vec4d a, vec4d b) { return { { a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3] } }; }
+#endif
+}
+}
+
+#endif // _SIMD_H
@@ -0,0 +1,297 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _SNAPSHOT_BUFFER_H
+#define _SNAPSHOT_BUFFER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ros/ros.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <Dense3DMT.h>
+
+namespace duo3d_driver
+{
+// Copy of a single Dense3D frame
+struct Snapshot
+{
+    // Origin of the disparity, stored as a bitmask in the raw format
+    enum { DISPARITY_BUILTIN = 1, DISPARITY_FILTERED = 2 };
+
+    uint32_t seq;
+    ros::Time stamp;
+    DUOFrame duoFrame;                  // IMU samples and frame info, image pointers refer to the buffers below
+    bool dense3dDataValid;
+    uint8_t disparitySource;            // 0 = Dense3D, DISPARITY_* flags otherwise
+    Dense3DParams dense3dParams;
+    std::vector<uint8_t> left;
+    std::vector<uint8_t> right;
+    std::vector<float> disparity;
+    std::vector<Dense3DDepth> depth;
+
+    // Copies the frame, reusing the buffers from a previous frame of the same size
+    void assign(const PDense3DFrame pFrame, uint8_t source, uint32_t frameSeq, const ros::Time &frameStamp)
+    {
+        size_t pixels = pFrame->duoFrame->width * pFrame->duoFrame->height;
+        seq = frameSeq;
+        stamp = frameStamp;
+        duoFrame = *pFrame->duoFrame;
+        left.assign(pFrame->duoFrame->leftData, pFrame->duoFrame->leftData + pixels);
+        right.assign(pFrame->duoFrame->rightData, pFrame->duoFrame->rightData + pixels);
+        duoFrame.leftData = left.data();
+        duoFrame.rightData = right.data();
+        dense3dDataValid = pFrame->dense3dDataValid;
+        disparitySource = source;
+        dense3dParams = pFrame->dense3dParams;
+        if(dense3dDataValid)
+        {
+            disparity.assign(pFrame->disparityData, pFrame->disparityData + pixels);
+            depth.assign(pFrame->depthData, pFrame->depthData + pixels);
+        }
+    }
+    // Returns a Dense3D frame referring to this copy
+    Dense3DFrame frame()
+    {
+        Dense3DFrame f;
+        f.duoFrame = &duoFrame;
+        f.dense3dDataValid = dense3dDataValid;
+        f.dense3dParams = dense3dParams;
+        f.disparityData = disparity.data();
+        f.depthData = depth.data();
+        return f;
+    }
+};
+typedef std::shared_ptr<Snapshot> SnapshotPtr;
+
+// Ring of the last N frames.
+// The capture thread fills a spare snapshot and swaps it into the ring, so
+// the ring lock is only held for a pointer exchange. Readers get shared
+// pointers and never block the capture thread while they use the data.
+class SnapshotBuffer
+{
+    std::mutex _mutex;
+    std::vector<SnapshotPtr> _ring;
+    size_t _next;
+    SnapshotPtr _spare;
+
+public:
+    SnapshotBuffer()
+        : _next(0)
+    {
+    }
+
+    void resize(int frames)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _ring.assign(std::max(frames, 0), SnapshotPtr());
+        _next = 0;
+    }
+    bool enabled()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return !_ring.empty();
+    }
+
+    // Stores a copy of the frame, evicting the oldest one
+    void push(const PDense3DFrame pFrame, uint8_t source, uint32_t seq, const ros::Time &stamp)
+    {
+        if(!_spare) _spare = std::make_shared<Snapshot>();
+        _spare->assign(pFrame, source, seq, stamp);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if(_ring.empty()) return;
+            _ring[_next].swap(_spare);
+            _next = (_next + 1) % _ring.size();
+        }
+        // Reuse the evicted buffers unless a reader still holds them
+        if(_spare && _spare.use_count() > 1) _spare.reset();
+    }
+
+    // Returns the frame 'age' frames before the newest one
+    SnapshotPtr frame(uint32_t age)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(age >= _ring.size()) return SnapshotPtr();
+        return _ring[(_next + _ring.size() - 1 - age) % _ring.size()];
+    }
+    // Returns all frames stamped within [start, end], oldest first
+    std::vector<SnapshotPtr> window(const ros::Time &start, const ros::Time &end)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::vector<SnapshotPtr> frames;
+        for(size_t i = 0; i < _ring.size(); i++)
+        {
+            const SnapshotPtr &s = _ring[(_next + i) % _ring.size()];
+            if(s && s->stamp >= start && s->stamp <= end)
+                frames.push_back(s);
+        }
+        return frames;
+    }
+};
+
+// Background thread that encodes and writes snapshots to disk
+class SnapshotWriter
+{
+public:
+    enum { FORMAT_PLY = 1, FORMAT_PNG = 2, FORMAT_RAW = 4 };
+
+private:
+    struct Job
+    {
+        SnapshotPtr snapshot;
+        std::string path;               // file path without extension
+        uint8_t formats;
+    };
+
+    Dense3DMTInstance _dense3dInstance;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<Job> _jobs;
+    bool _stop;
+
+public:
+    SnapshotWriter()
+        : _dense3dInstance(NULL),
+          _stop(true)
+    {
+    }
+    ~SnapshotWriter()
+    {
+        stop();
+    }
+
+    void start(Dense3DMTInstance dense3dInstance)
+    {
+        _dense3dInstance = dense3dInstance;
+        _stop = false;
+        _thread = std::thread(&SnapshotWriter::writerLoop, this);
+    }
+    // Finishes the queued jobs and stops the writer thread
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        if(_thread.joinable()) _thread.join();
+    }
+
+    // Queues a snapshot, returns false if the writer is not running
+    bool write(const SnapshotPtr &snapshot, const std::string &directory, uint8_t formats)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "/duo3d_%06u_%u.%09u", snapshot->seq, snapshot->stamp.sec, snapshot->stamp.nsec);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if(_stop) return false;
+            _jobs.push_back({snapshot, directory + name, formats});
+        }
+        _wake.notify_one();
+        return true;
+    }
+
+private:
+    void writerLoop()
+    {
+        for(;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [this]{ return _stop || !_jobs.empty(); });
+                if(_jobs.empty()) return;
+                job = _jobs.front();
+                _jobs.pop_front();
+            }
+            if(job.formats & FORMAT_PLY) writePLY(job);
+            if(job.formats & FORMAT_PNG) writePNG(job);
+            if(job.formats & FORMAT_RAW) writeRaw(job);
+        }
+    }
+
+    void writePLY(const Job &job)
+    {
+        if(!job.snapshot->dense3dDataValid)
+        {
+            ROS_WARN("Frame %u has no Dense3D data, skipping PLY export", job.snapshot->seq);
+            return;
+        }
+        std::string file = job.path + ".ply";
+        Dense3DFrame frame = job.snapshot->frame();
+        if(!Dense3DSavePLY(_dense3dInstance, const_cast<char*>(file.c_str()), &frame))
+            ROS_ERROR("Could not save %s", file.c_str());
+    }
+    // Saves the images and the disparity as 16-bit PNG in 1/16 pixel units
+    void writePNG(const Job &job)
+    {
+        Snapshot &s = *job.snapshot;
+        cv::Size size(s.duoFrame.width, s.duoFrame.height);
+        bool ok = cv::imwrite(job.path + "_left.png", cv::Mat(size, CV_8UC1, s.left.data())) &&
+                  cv::imwrite(job.path + "_right.png", cv::Mat(size, CV_8UC1, s.right.data()));
+        if(ok && s.dense3dDataValid)
+        {
+            cv::Mat disparity16;
+            cv::Mat(size, CV_32FC1, s.disparity.data()).convertTo(disparity16, CV_16UC1, 16.0);
+            ok = cv::imwrite(job.path + "_disparity.png", disparity16);
+        }
+        if(!ok) ROS_ERROR("Could not save %s PNG images", job.path.c_str());
+    }
+    // Raw format: DUOFrame header (with IMU samples), Dense3DParams, validity flag,
+    // disparity source flags, followed by the left and right images, disparity
+    // and depth buffers
+    void writeRaw(const Job &job)
+    {
+        Snapshot &s = *job.snapshot;
+        std::string file = job.path + ".raw";
+        FILE *fp = fopen(file.c_str(), "wb");
+        if(!fp)
+        {
+            ROS_ERROR("Could not open %s", file.c_str());
+            return;
+        }
+        uint8_t valid = s.dense3dDataValid;
+        bool ok = fwrite(&s.duoFrame, sizeof(s.duoFrame), 1, fp) == 1 &&
+                  fwrite(&s.dense3dParams, sizeof(s.dense3dParams), 1, fp) == 1 &&
+                  fwrite(&valid, sizeof(valid), 1, fp) == 1 &&
+                  fwrite(&s.disparitySource, sizeof(s.disparitySource), 1, fp) == 1 &&
+                  fwrite(s.left.data(), s.left.size(), 1, fp) == 1 &&
+                  fwrite(s.right.data(), s.right.size(), 1, fp) == 1;
+        if(ok && valid)
+            ok = fwrite(s.disparity.data(), sizeof(float), s.disparity.size(), fp) == s.disparity.size() &&
+                 fwrite(s.depth.data(), sizeof(Dense3DDepth), s.depth.size(), fp) == s.depth.size();
+        if(fclose(fp) != 0 || !ok)
+            ROS_ERROR("Could not write %s", file.c_str());
+    }
+};
+}
+
+#endif // _SNAPSHOT_BUFFER_H
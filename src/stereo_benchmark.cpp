@@ -0,0 +1,172 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+// Runs the built-in stereo matcher on frames recorded with the
+// save_snapshot service (raw format) and reports the processing time.
+// If the recording holds disparity, the results are compared with it and
+// labelled with the engine and filter that produced it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "stereo_matcher.h"
+
+using namespace std;
+using namespace duo3d_driver;
+
+// Disparity source flags of the raw format, see Snapshot in snapshot_buffer.h
+enum { DISPARITY_BUILTIN = 1, DISPARITY_FILTERED = 2 };
+
+struct RawFrame
+{
+    DUOFrame duoFrame;
+    Dense3DParams dense3dParams;
+    uint8_t dense3dDataValid;
+    uint8_t disparitySource;
+    vector<uint8_t> left;
+    vector<uint8_t> right;
+    vector<float> disparity;
+};
+
+static bool readRaw(const char *file, RawFrame &frame)
+{
+    FILE *fp = fopen(file, "rb");
+    if(!fp) return false;
+    bool ok = fread(&frame.duoFrame, sizeof(frame.duoFrame), 1, fp) == 1 &&
+              fread(&frame.dense3dParams, sizeof(frame.dense3dParams), 1, fp) == 1 &&
+              fread(&frame.dense3dDataValid, sizeof(frame.dense3dDataValid), 1, fp) == 1 &&
+              fread(&frame.disparitySource, sizeof(frame.disparitySource), 1, fp) == 1;
+    if(ok)
+    {
+        size_t pixels = frame.duoFrame.width * frame.duoFrame.height;
+        frame.left.resize(pixels);
+        frame.right.resize(pixels);
+        ok = fread(frame.left.data(), pixels, 1, fp) == 1 &&
+             fread(frame.right.data(), pixels, 1, fp) == 1;
+        if(ok && frame.dense3dDataValid)
+        {
+            frame.disparity.resize(pixels);
+            ok = fread(frame.disparity.data(), sizeof(float), pixels, fp) == pixels;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+static void usage()
+{
+    printf("Usage: duo3d_stereo_benchmark [options] frame.raw ...\n"
+           "  -m bm|sgm       matching mode (default: from recording)\n"
+           "  -c census|sad   matching cost (default: census)\n"
+           "  -d <n>          number of disparities (default: from recording)\n"
+           "  -w <n>          BM window radius (default: from recording)\n"
+           "  -t <n>          number of threads, 0 = number of cores (default: 0)\n"
+           "  -n <n>          iterations per frame, at least 1 (default: 10)\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = NULL, *cost = "census";
+    int disparities = 0, radius = 0, threads = 0, iterations = 10;
+    vector<string> files;
+    for(int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if(arg == "-m" && hasValue) mode = argv[++i];
+        else if(arg == "-c" && hasValue) cost = argv[++i];
+        else if(arg == "-d" && hasValue) disparities = atoi(argv[++i]);
+        else if(arg == "-w" && hasValue) radius = atoi(argv[++i]);
+        else if(arg == "-t" && hasValue) threads = atoi(argv[++i]);
+        else if(arg == "-n" && hasValue) iterations = atoi(argv[++i]);
+        else if(arg[0] == '-') { usage(); return 1; }
+        else files.push_back(arg);
+    }
+    if(files.empty() || iterations < 1) { usage(); return 1; }
+
+    ThreadPool pool;
+    pool.start(threads, vector<int>());
+    StereoMatcher matcher(pool);
+    printf("SIMD: %s, threads: %d\n", StereoMatcher::simdName(), pool.size());
+
+    double totalMs = 0;
+    int totalRuns = 0;
+    for(const string &file : files)
+    {
+        RawFrame frame;
+        if(!readRaw(file.c_str(), frame))
+        {
+            fprintf(stderr, "Could not read %s\n", file.c_str());
+            return 1;
+        }
+        int width = frame.duoFrame.width, height = frame.duoFrame.height;
+
+        StereoMatcherParams params;
+        params.fromDense3D(frame.dense3dParams);
+        if(mode) params.mode = strcmp(mode, "bm") == 0 ? StereoMatcherParams::BM : StereoMatcherParams::SGM;
+        params.cost = strcmp(cost, "sad") == 0 ? StereoMatcherParams::SAD : StereoMatcherParams::CENSUS;
+        if(disparities) params.numDisparities = disparities;
+        if(radius) params.windowRadius = radius;
+        matcher.setParams(params);
+
+        vector<float> disparity(width * height);
+        matcher.compute(frame.left.data(), frame.right.data(), width, height, disparity.data());    // warm-up
+        auto start = chrono::steady_clock::now();
+        for(int i = 0; i < iterations; i++)
+            matcher.compute(frame.left.data(), frame.right.data(), width, height, disparity.data());
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / iterations;
+        totalMs += ms * iterations;
+        totalRuns += iterations;
+
+        size_t valid = 0;
+        for(float d : disparity) if(d > 0) valid++;
+        printf("%s: %dx%d, %s/%s, %d disparities: %.2f ms, %.1f%% valid",
+               file.c_str(), width, height,
+               params.mode == StereoMatcherParams::SGM ? "SGM" : "BM",
+               params.cost == StereoMatcherParams::SAD ? "SAD" : "Census",
+               params.numDisparities, ms, 100.0 * valid / disparity.size());
+
+        // Compare with the recorded disparity where both are valid
+        if(frame.dense3dDataValid)
+        {
+            size_t both = 0, close = 0;
+            double error = 0;
+            for(size_t i = 0; i < disparity.size(); i++)
+            {
+                if(disparity[i] <= 0 || frame.disparity[i] <= 0) continue;
+                double diff = fabs(disparity[i] - frame.disparity[i]);
+                both++;
+                error += diff;
+                if(diff <= 1.0) close++;
+            }
+            if(both)
+                printf(", vs recorded %s%s: mean error %.2f px, %.1f%% within 1 px",
+                       (frame.disparitySource & DISPARITY_BUILTIN) ? "built-in" : "Dense3D",
+                       (frame.disparitySource & DISPARITY_FILTERED) ? " (filtered)" : "",
+                       error / both, 100.0 * close / both);
+        }
+        printf("\n");
+    }
+    printf("Average: %.2f ms/frame\n", totalMs / totalRuns);
+    return 0;
+}
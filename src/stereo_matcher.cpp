@@ -0,0 +1,364 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#include "stereo_matcher.h"
+
+#include <stdlib.h>
+#include <algorithm>
+
+#include "simd.h"
+
+namespace duo3d_driver
+{
+namespace
+{
+using namespace simd;
+
+// Path cost at the borders of the disparity range, never selected
+const int16_t PATH_BORDER = 0x3fff;
+
+inline int clamp(int v, int lo, int hi) { return std::max(lo, std::min(v, hi)); }
+
+// One SGM path step for a single pixel.
+// prev and cur hold D path costs with a border element on each side.
+// Returns the minimum of the new path costs.
+inline int16_t pathStep(const uint8_t *cost, const int16_t *prev, int16_t prevMin, int16_t *cur,
+                        int16_t *sum, bool accumulate, int disparities, vec p1, vec p2)
+{
+    vec minPrev = vset(prevMin);
+    vec jump = vadds(minPrev, p2);
+    vec minCur = vset(PATH_BORDER);
+    for(int d = 0; d < disparities; d += LANES)
+    {
+        vec same = vload(prev + 1 + d);
+        vec lower = vadds(vload(prev + d), p1);
+        vec upper = vadds(vload(prev + 2 + d), p1);
+        vec best = vmin(vmin(same, jump), vmin(lower, upper));
+        vec v = vsub(vadd(vloadu8(cost + d), best), minPrev);
+        vstore(cur + 1 + d, v);
+        minCur = vmin(minCur, v);
+        vstore(sum + d, accumulate ? vadds(vload(sum + d), v) : v);
+    }
+    return vhmin(minCur);
+}
+}
+
+void StereoMatcher::setParams(const StereoMatcherParams &params)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _params = params;
+}
+
+StereoMatcherParams StereoMatcher::params()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _params;
+}
+
+const char *StereoMatcher::simdName()
+{
+    return SIMD_NAME;
+}
+
+void StereoMatcher::compute(const uint8_t *left, const uint8_t *right, int width, int height, float *disparity)
+{
+    StereoMatcherParams params = this->params();
+    params.numDisparities = clamp((params.numDisparities + 15) / 16 * 16, 16, 256);
+    params.windowRadius = clamp(params.windowRadius, 1, 10);
+    params.preFilterCap = clamp(params.preFilterCap, 1, 63);
+    int disparities = params.numDisparities;
+    size_t pixels = (size_t)width * height;
+
+    _cost.resize(pixels * disparities);
+    _aggregated.resize(pixels * disparities);
+
+    computeCost(left, right, width, height, params);
+    if(params.mode == StereoMatcherParams::SGM)
+        aggregatePaths(width, height, disparities, params.p1, params.p2);
+    else
+        aggregateBlocks(width, height, disparities, params.windowRadius);
+    selectDisparity(width, height, params, disparity);
+}
+
+// 5x5 census transform, 24 bits set where the neighbour is darker than the center
+void StereoMatcher::computeCensus(const uint8_t *image, int width, int height, uint32_t *census)
+{
+    _pool.parallelRows(height, width, [&](int begin, int end, int)
+    {
+        for(int y = begin; y < end; y++)
+        {
+            uint32_t *dst = census + (size_t)y * width;
+            if(y < 2 || y >= height - 2)
+            {
+                std::fill(dst, dst + width, 0);
+                continue;
+            }
+            for(int x = 0; x < width; x++)
+            {
+                if(x < 2 || x >= width - 2)
+                {
+                    dst[x] = 0;
+                    continue;
+                }
+                const uint8_t *center = image + (size_t)y * width + x;
+                uint32_t bits = 0;
+                for(int dy = -2; dy <= 2; dy++)
+                    for(int dx = -2; dx <= 2; dx++)
+                        if(dy != 0 || dx != 0)
+                            bits = (bits << 1) | (center[dy * width + dx] < *center);
+                dst[x] = bits;
+            }
+        }
+    });
+}
+
+void StereoMatcher::computeCost(const uint8_t *left, const uint8_t *right, int width, int height,
+                                const StereoMatcherParams &params)
+{
+    int disparities = params.numDisparities;
+    bool census = (params.cost == StereoMatcherParams::CENSUS);
+    uint8_t maxCost = census ? 24 : params.preFilterCap;
+    if(census)
+    {
+        _censusLeft.resize((size_t)width * height);
+        _censusRight.resize((size_t)width * height);
+        computeCensus(left, width, height, _censusLeft.data());
+        computeCensus(right, width, height, _censusRight.data());
+    }
+    _pool.parallelRows(height, (size_t)width * disparities, [&](int begin, int end, int)
+    {
+        for(int y = begin; y < end; y++)
+        {
+            size_t row = (size_t)y * width;
+            for(int x = 0; x < width; x++)
+            {
+                uint8_t *cost = &_cost[(row + x) * disparities];
+                int valid = std::min(x + 1, disparities);
+                if(census)
+                {
+                    uint32_t l = _censusLeft[row + x];
+                    const uint32_t *r = &_censusRight[row + x];
+                    for(int d = 0; d < valid; d++)
+                        cost[d] = __builtin_popcount(l ^ r[-d]);
+                }
+                else
+                {
+                    int l = left[row + x];
+                    const uint8_t *r = &right[row + x];
+                    for(int d = 0; d < valid; d++)
+                        cost[d] = std::min(abs(l - r[-d]), (int)maxCost);
+                }
+                std::fill(cost + valid, cost + disparities, maxCost);
+            }
+        }
+    });
+}
+
+// Box filter aggregation with running column sums.
+// Each band starts its column sums from scratch, so bands are independent.
+void StereoMatcher::aggregateBlocks(int width, int height, int disparities, int radius)
+{
+    _pool.parallelRows(height, (size_t)width * disparities, [&](int begin, int end, int)
+    {
+        std::vector<int16_t> columns((size_t)width * disparities, 0);
+        auto addRow = [&](int y, bool subtract)
+        {
+            const uint8_t *cost = &_cost[(size_t)clamp(y, 0, height - 1) * width * disparities];
+            for(size_t i = 0; i < columns.size(); i += LANES)
+            {
+                vec c = vload(&columns[i]);
+                vec v = vloadu8(cost + i);
+                vstore(&columns[i], subtract ? vsub(c, v) : vadd(c, v));
+            }
+        };
+        for(int y = begin - radius; y <= begin + radius; y++)
+            addRow(y, false);
+
+        for(int y = begin; y < end; y++)
+        {
+            int16_t *sum = &_aggregated[(size_t)y * width * disparities];
+            for(int d = 0; d < disparities; d += LANES)
+            {
+                vec s = vset(0);
+                for(int x = -radius; x <= radius; x++)
+                    s = vadd(s, vload(&columns[(size_t)clamp(x, 0, width - 1) * disparities + d]));
+                vstore(sum + d, s);
+                for(int x = 1; x < width; x++)
+                {
+                    s = vadd(s, vload(&columns[(size_t)std::min(x + radius, width - 1) * disparities + d]));
+                    s = vsub(s, vload(&columns[(size_t)std::max(x - radius - 1, 0) * disparities + d]));
+                    vstore(sum + (size_t)x * disparities + d, s);
+                }
+            }
+            if(y + 1 < end)
+            {
+                addRow(y + radius + 1, false);
+                addRow(y - radius, true);
+            }
+        }
+    });
+}
+
+// Semi-global aggregation along the horizontal and vertical scanlines.
+// Horizontal paths run per row, vertical paths per column strip.
+void StereoMatcher::aggregatePaths(int width, int height, int disparities, int p1, int p2)
+{
+    vec vp1 = vset(p1), vp2 = vset(p2);
+    size_t stride = disparities + 2;
+
+    _pool.parallelRows(height, (size_t)width * disparities, [&](int begin, int end, int)
+    {
+        std::vector<int16_t> prev(stride), cur(stride);
+        for(int y = begin; y < end; y++)
+        {
+            const uint8_t *cost = &_cost[(size_t)y * width * disparities];
+            int16_t *sum = &_aggregated[(size_t)y * width * disparities];
+            for(int pass = 0; pass < 2; pass++)
+            {
+                std::fill(prev.begin(), prev.end(), 0);
+                prev[0] = prev[stride - 1] = cur[0] = cur[stride - 1] = PATH_BORDER;
+                int16_t prevMin = 0;
+                for(int i = 0; i < width; i++)
+                {
+                    size_t x = pass == 0 ? i : width - 1 - i;
+                    prevMin = pathStep(cost + x * disparities, prev.data(), prevMin, cur.data(),
+                                       sum + x * disparities, pass == 1, disparities, vp1, vp2);
+                    prev.swap(cur);
+                }
+            }
+        }
+    });
+
+    const int strip = 16;
+    _pool.parallelFor((width + strip - 1) / strip, [&](int index)
+    {
+        int x0 = index * strip, x1 = std::min(width, x0 + strip);
+        std::vector<int16_t> prev((x1 - x0) * stride), cur((x1 - x0) * stride);
+        std::vector<int16_t> prevMin(x1 - x0), curMin(x1 - x0);
+        for(int pass = 0; pass < 2; pass++)
+        {
+            std::fill(prev.begin(), prev.end(), 0);
+            std::fill(prevMin.begin(), prevMin.end(), 0);
+            for(int x = 0; x < x1 - x0; x++)
+            {
+                prev[x * stride] = prev[x * stride + stride - 1] = PATH_BORDER;
+                cur[x * stride] = cur[x * stride + stride - 1] = PATH_BORDER;
+            }
+            for(int i = 0; i < height; i++)
+            {
+                size_t y = pass == 0 ? i : height - 1 - i;
+                for(int x = x0; x < x1; x++)
+                {
+                    size_t offset = (y * width + x) * disparities;
+                    int k = x - x0;
+                    curMin[k] = pathStep(&_cost[offset], &prev[k * stride], prevMin[k], &cur[k * stride],
+                                         &_aggregated[offset], true, disparities, vp1, vp2);
+                }
+                prev.swap(cur);
+                prevMin.swap(curMin);
+            }
+        }
+    });
+}
+
+// Winner-takes-all with uniqueness test, left-right check and parabolic sub-pixel fit
+void StereoMatcher::selectDisparity(int width, int height, const StereoMatcherParams &params, float *disparity)
+{
+    int disparities = params.numDisparities;
+    int ratio = params.uniquenessRatio;
+    _pool.parallelRows(height, (size_t)width * disparities * sizeof(int16_t), [&](int begin, int end, int)
+    {
+        std::vector<int> rightDisparity(width, -1);
+        for(int y = begin; y < end; y++)
+        {
+            const int16_t *row = &_aggregated[(size_t)y * width * disparities];
+            float *dst = disparity + (size_t)y * width;
+
+            if(params.lrCheck)
+            {
+                // Best match of each right image pixel along the diagonal of the cost volume
+                for(int xr = 0; xr < width; xr++)
+                {
+                    int best = 0, bestCost = INT32_MAX;
+                    int valid = std::min(width - xr, disparities);
+                    for(int d = 0; d < valid; d++)
+                    {
+                        int c = row[(size_t)(xr + d) * disparities + d];
+                        if(c < bestCost) { bestCost = c; best = d; }
+                    }
+                    rightDisparity[xr] = best;
+                }
+            }
+
+            for(int x = 0; x < width; x++)
+            {
+                const int16_t *cost = row + (size_t)x * disparities;
+                int valid = std::min(x + 1, disparities);
+                int best = 0, bestCost = INT32_MAX;
+                for(int d = 0; d < valid; d++)
+                    if(cost[d] < bestCost) { bestCost = cost[d]; best = d; }
+
+                bool unique = true;
+                for(int d = 0; d < valid && unique; d++)
+                    if(abs(d - best) > 1 && cost[d] * (100 - ratio) < bestCost * 100)
+                        unique = false;
+                if(!unique || best == 0 || (params.lrCheck && abs(rightDisparity[x - best] - best) > 1))
+                {
+                    dst[x] = 0.0f;
+                    continue;
+                }
+
+                float delta = 0.0f;
+                if(best + 1 < valid)
+                {
+                    int denom = cost[best - 1] + cost[best + 1] - 2 * bestCost;
+                    if(denom > 0) delta = (cost[best - 1] - cost[best + 1]) / (2.0f * denom);
+                }
+                dst[x] = best + delta;
+            }
+        }
+    });
+}
+
+void StereoMatcher::reproject(const float *disparity, int width, int height, const double Q[16], Dense3DDepth *depth)
+{
+    _pool.parallelRows(height, (size_t)width * sizeof(Dense3DDepth), [&](int begin, int end, int)
+    {
+        for(int y = begin; y < end; y++)
+        {
+            for(int x = 0; x < width; x++)
+            {
+                size_t i = (size_t)y * width + x;
+                Dense3DDepth &p = depth[i];
+                double w = Q[14] * disparity[i] + Q[15];
+                double z = Q[11] / w;
+                if(disparity[i] <= 0.0f || w <= 0.0 || z <= 0.0 || z >= INVALID_DEPTH)
+                {
+                    p.x = p.y = 0.0f;
+                    p.z = INVALID_DEPTH;
+                    continue;
+                }
+                p.x = (Q[0] * x + Q[3]) / w;
+                p.y = (Q[5] * y + Q[7]) / w;
+                p.z = z;
+            }
+        }
+    });
+}
+}
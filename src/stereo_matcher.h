@@ -0,0 +1,119 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _STEREO_MATCHER_H
+#define _STEREO_MATCHER_H
+
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+#include <Dense3DMT.h>
+
+#include "depth.h"
+#include "thread_pool.h"
+
+namespace duo3d_driver
+{
+struct StereoMatcherParams
+{
+    enum { BM, SGM };
+    enum { CENSUS, SAD };
+
+    int mode;                           // BM or SGM
+    int cost;                           // Census (5x5) or SAD (truncated at preFilterCap)
+    int numDisparities;                 // Disparity range in pixels, multiple of 16
+    int windowRadius;                   // Aggregation window radius for BM
+    int preFilterCap;                   // SAD cost truncation [1, 63]
+    int uniquenessRatio;                // Best cost must beat the second best by this margin in percent
+    int p1;                             // SGM penalty for disparity changes of 1
+    int p2;                             // SGM penalty for larger disparity changes
+    bool lrCheck;                       // Left-right consistency check
+
+    StereoMatcherParams()
+        : mode(SGM),
+          cost(CENSUS),
+          numDisparities(64),
+          windowRadius(3),
+          preFilterCap(31),
+          uniquenessRatio(10),
+          p1(8),
+          p2(32),
+          lrCheck(true)
+    {
+    }
+    // Maps the Dense3D parameters onto the matcher parameters
+    void fromDense3D(const Dense3DParams &params)
+    {
+        mode = (params.mode == 1 || params.mode == 3) ? SGM : BM;
+        numDisparities = params.numDisparities * 16;
+        windowRadius = params.sadWindowSize;
+        preFilterCap = params.preFilterCap;
+        uniquenessRatio = params.uniqenessRatio;
+    }
+};
+
+// Open block matching / semi-global stereo matcher.
+// The matching cost volume is computed per row band, aggregated either with
+// a box filter (BM) or along 4 scanline paths (SGM: left, right, top, bottom)
+// and reduced by winner-takes-all with sub-pixel refinement. The aggregation
+// loops are vectorized with AVX2, SSE2 or NEON depending on the build target.
+// Results do not depend on the number of threads of the pool.
+class StereoMatcher
+{
+    ThreadPool &_pool;
+    std::mutex _mutex;
+    StereoMatcherParams _params;
+
+    // Buffers reused between frames
+    std::vector<uint32_t> _censusLeft;
+    std::vector<uint32_t> _censusRight;
+    std::vector<uint8_t> _cost;         // H x W x D matching costs
+    std::vector<int16_t> _aggregated;   // H x W x D aggregated costs
+    std::vector<int16_t> _rightDisparity;
+
+public:
+    StereoMatcher(ThreadPool &pool)
+        : _pool(pool)
+    {
+    }
+
+    void setParams(const StereoMatcherParams &params);
+    StereoMatcherParams params();
+
+    // Computes the left disparity in pixels, invalid pixels are set to 0
+    void compute(const uint8_t *left, const uint8_t *right, int width, int height, float *disparity);
+
+    // Converts the disparity to 3D points in the units of Q (DUO: millimeters).
+    // Pixels without disparity get z = INVALID_DEPTH.
+    void reproject(const float *disparity, int width, int height, const double Q[16], Dense3DDepth *depth);
+
+    // Name of the instruction set used by the aggregation loops
+    static const char *simdName();
+
+private:
+    void computeCensus(const uint8_t *image, int width, int height, uint32_t *census);
+    void computeCost(const uint8_t *left, const uint8_t *right, int width, int height, const StereoMatcherParams &params);
+    void aggregateBlocks(int width, int height, int disparities, int radius);
+    void aggregatePaths(int width, int height, int disparities, int p1, int p2);
+    void selectDisparity(int width, int height, const StereoMatcherParams &params, float *disparity);
+};
+}
+
+#endif // _STEREO_MATCHER_H
@@ -0,0 +1,115 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#include "temporal_filter.h"
+
+#include <algorithm>
+
+#include "simd.h"
+
+namespace duo3d_driver
+{
+using namespace simd;
+
+// Confidence below which a hole pixel forgets its history
+#define CONFIDENCE_EPSILON  0.01f
+
+void TemporalFilter::setParams(const TemporalFilterParams &params)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _params = params;
+}
+
+void TemporalFilter::reset()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _reset = true;
+}
+
+void TemporalFilter::apply(float *disparity, int width, int height)
+{
+    TemporalFilterParams params;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        params = _params;
+        size_t pixels = (size_t)width * height;
+        if(_reset || _history.size() != pixels)
+        {
+            _history.assign(pixels, 0.0f);
+            _confidence.assign(pixels, 0.0f);
+            _reset = false;
+        }
+    }
+
+    vecf zero = vsetf(0.0f), one = vsetf(1.0f);
+    vecf alpha = vsetf(params.alpha), keep = vsetf(1.0f - params.alpha);
+    vecf threshold = vsetf(params.outlierThreshold);
+    vecf minConfidence = vsetf(params.minConfidence);
+    vecf epsilon = vsetf(CONFIDENCE_EPSILON);
+
+    // Row bands are padded to whole vectors, the remainder is done with scalar lanes
+    _pool.parallelRows(height, width * 3 * sizeof(float), [&](int begin, int end, int)
+    {
+        size_t i = (size_t)begin * width, last = (size_t)end * width;
+        auto step = [&](float *d, float *h, float *c)
+        {
+            vecf dv = vloadf(d), hv = vloadf(h), cv = vloadf(c);
+            maskf measured = vgtf(dv, zero);
+            maskf known = vgtf(cv, zero);
+            maskf close = vlef(vabsf(vsubf(dv, hv)), threshold);
+            vecf decayed = vmulf(cv, keep);
+
+            // Agreeing measurement: blend into the history and gain confidence
+            maskf agree = vandm(vandm(measured, known), close);
+            vecf h1 = vselectf(agree, vaddf(hv, vmulf(alpha, vsubf(dv, hv))), hv);
+            vecf c1 = vselectf(agree, vaddf(cv, vmulf(alpha, vsubf(one, cv))), cv);
+
+            // Outlier: decay, replace the history once it is no longer trusted
+            maskf outlier = vandnotm(close, vandm(measured, known));
+            maskf replace = vorm(vandnotm(known, measured), vandnotm(vlef(minConfidence, decayed), outlier));
+            c1 = vselectf(outlier, decayed, c1);
+            h1 = vselectf(replace, dv, h1);
+            c1 = vselectf(replace, alpha, c1);
+
+            // Hole: keep the history while the confidence decays
+            maskf hole = vandnotm(measured, known);
+            c1 = vselectf(hole, vselectf(vgtf(decayed, epsilon), decayed, zero), c1);
+
+            vstoref(h, h1);
+            vstoref(c, c1);
+            vstoref(d, vselectf(vlef(minConfidence, c1), h1, zero));
+        };
+        for(; i + LANESF <= last; i += LANESF)
+            step(disparity + i, &_history[i], &_confidence[i]);
+        // Remaining pixels one lane at a time through a padded copy
+        if(i < last)
+        {
+            float d[LANESF] = {0}, h[LANESF] = {0}, c[LANESF] = {0};
+            size_t n = last - i;
+            std::copy(disparity + i, disparity + last, d);
+            std::copy(&_history[i], &_history[i] + n, h);
+            std::copy(&_confidence[i], &_confidence[i] + n, c);
+            step(d, h, c);
+            std::copy(d, d + n, disparity + i);
+            std::copy(h, h + n, &_history[i]);
+            std::copy(c, c + n, &_confidence[i]);
+        }
+    });
+}
+}
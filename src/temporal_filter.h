@@ -0,0 +1,81 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _TEMPORAL_FILTER_H
+#define _TEMPORAL_FILTER_H
+
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace duo3d_driver
+{
+struct TemporalFilterParams
+{
+    float alpha;                        // Weight of the new disparity in the history (0, 1]
+    float outlierThreshold;             // Maximum disparity change in pixels accepted as the same surface
+    float minConfidence;                // Minimum confidence for a pixel to be output
+
+    TemporalFilterParams()
+        : alpha(0.4f),
+          outlierThreshold(2.0f),
+          minConfidence(0.3f)
+    {
+    }
+};
+
+// Per-pixel exponentially weighted disparity filter.
+// Each pixel keeps a disparity history and a confidence in [0, 1].
+// Measurements that agree with the history are blended into it and raise
+// the confidence, outliers and holes decay it. Holes are filled with the
+// history as long as the confidence stays above minConfidence, outliers
+// replace the history once it has decayed below that level.
+// The filter runs in place on the disparity buffer, invalid pixels are 0.
+class TemporalFilter
+{
+    ThreadPool &_pool;
+    std::mutex _mutex;
+    TemporalFilterParams _params;
+    bool _reset;
+
+    // History buffers reused between frames
+    std::vector<float> _history;
+    std::vector<float> _confidence;
+
+public:
+    TemporalFilter(ThreadPool &pool)
+        : _pool(pool),
+          _reset(true)
+    {
+    }
+
+    void setParams(const TemporalFilterParams &params);
+    // Drops the history, e.g. after the disparity range has changed
+    void reset();
+
+    void apply(float *disparity, int width, int height);
+
+    // Per-pixel confidence of the last filtered frame
+    const float *confidence() const { return _confidence.data(); }
+};
+}
+
+#endif // _TEMPORAL_FILTER_H
@@ -0,0 +1,243 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace duo3d_driver
+{
+// Fixed size thread pool for data parallel per-pixel stages.
+// A job is split into 'count' independent tasks that are spread over
+// per-thread queues in contiguous chunks. Each thread drains its own queue
+// from the front and steals from the back of the other queues once it runs
+// dry. The calling thread takes part in the job, so a pool of N threads
+// starts N-1 workers.
+class ThreadPool
+{
+    // Target amount of source data per row band, sized to stay in L2
+    enum { BAND_BYTES = 64 * 1024 };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::thread> _workers;
+    std::vector<std::unique_ptr<Queue>> _queues;
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    const std::function<void(int)> *_task;
+    uint64_t _generation;
+    int _active;
+    std::atomic<int> _pending;
+    bool _stop;
+
+public:
+    ThreadPool()
+        : _task(NULL),
+          _generation(0),
+          _active(0),
+          _pending(0),
+          _stop(false)
+    {
+        _queues.emplace_back(new Queue);
+    }
+    ~ThreadPool()
+    {
+        stop();
+    }
+
+    // Starts the worker threads. 'threads' is the total number of threads
+    // including the caller, 0 selects the number of hardware threads.
+    // Workers are pinned round-robin to the given CPUs if any are specified,
+    // the CPUs that could not be used are returned. The caller is not pinned.
+    std::vector<int> start(int threads, const std::vector<int> &cpus)
+    {
+        stop();
+        if(threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        _stop = false;
+        for(int i = 1; i < threads; i++)
+            _queues.emplace_back(new Queue);
+        std::vector<int> failed;
+        for(int i = 1; i < threads; i++)
+        {
+            _workers.emplace_back(&ThreadPool::workerLoop, this, i);
+            if(cpus.empty()) continue;
+            int cpu = cpus[(i - 1) % cpus.size()];
+            if(!setAffinity(_workers.back(), cpu) && std::find(failed.begin(), failed.end(), cpu) == failed.end())
+                failed.push_back(cpu);
+        }
+        return failed;
+    }
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for(auto &worker : _workers)
+            worker.join();
+        _workers.clear();
+        _queues.resize(1);
+    }
+
+    // Number of threads taking part in a job, including the caller
+    int size() const { return _queues.size(); }
+
+    // Runs task(i) for i in [0, count) and returns when all tasks are done.
+    // Tasks must write to disjoint memory, the execution order is undefined.
+    void parallelFor(int count, const std::function<void(int)> &task)
+    {
+        if(count <= 0) return;
+        if(_workers.empty() || count == 1)
+        {
+            for(int i = 0; i < count; i++) task(i);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            // Give each queue a contiguous chunk to keep neighbouring bands together
+            int queues = _queues.size();
+            for(int q = 0; q < queues; q++)
+            {
+                std::lock_guard<std::mutex> qlock(_queues[q]->mutex);
+                for(int i = q * count / queues; i < (q + 1) * count / queues; i++)
+                    _queues[q]->tasks.push_back(i);
+            }
+            _pending = count;
+            _task = &task;
+            _generation++;
+        }
+        _wake.notify_all();
+
+        runTasks(0, task);
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this]{ return _pending == 0 && _active == 0; });
+        _task = NULL;
+    }
+
+    // Splits 'rows' into bands of roughly BAND_BYTES of source data and runs
+    // band(begin, end, index) for each of them. Band boundaries only depend
+    // on the image geometry, never on the number of threads.
+    void parallelRows(int rows, size_t rowBytes, const std::function<void(int, int, int)> &band)
+    {
+        int bandRows = bandHeight(rows, rowBytes);
+        int bands = (rows + bandRows - 1) / bandRows;
+        parallelFor(bands, [&](int i)
+        {
+            band(i * bandRows, std::min(rows, (i + 1) * bandRows), i);
+        });
+    }
+
+    // Returns the number of rows in each band used by parallelRows
+    static int bandHeight(int rows, size_t rowBytes)
+    {
+        int bandRows = std::max<size_t>(1, BAND_BYTES / std::max<size_t>(rowBytes, 1));
+        return std::min(bandRows, std::max(rows, 1));
+    }
+
+private:
+    void workerLoop(int index)
+    {
+        uint64_t seen = 0;
+        for(;;)
+        {
+            const std::function<void(int)> *task;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [&]{ return _stop || (_task && _generation != seen); });
+                if(_stop) return;
+                seen = _generation;
+                task = _task;
+                _active++;
+            }
+            runTasks(index, *task);
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _active--;
+            }
+            _done.notify_all();
+        }
+    }
+    void runTasks(int self, const std::function<void(int)> &task)
+    {
+        int index;
+        while(pop(self, index) || steal(self, index))
+        {
+            task(index);
+            if(--_pending == 0)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _done.notify_all();
+            }
+        }
+    }
+    bool pop(int self, int &index)
+    {
+        Queue &queue = *_queues[self];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.tasks.empty()) return false;
+        index = queue.tasks.front();
+        queue.tasks.pop_front();
+        return true;
+    }
+    bool steal(int self, int &index)
+    {
+        int queues = _queues.size();
+        for(int i = 1; i < queues; i++)
+        {
+            Queue &queue = *_queues[(self + i) % queues];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if(queue.tasks.empty()) continue;
+            index = queue.tasks.back();
+            queue.tasks.pop_back();
+            return true;
+        }
+        return false;
+    }
+    static bool setAffinity(std::thread &thread, int cpu)
+    {
+        if(cpu < 0 || cpu >= CPU_SETSIZE) return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+    }
+};
+}
+
+#endif // _THREAD_POOL_H
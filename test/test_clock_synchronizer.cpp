@@ -0,0 +1,137 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016, Code laboratories, Inc.
+//
+// All rights reserved.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+#include <gtest/gtest.h>
+#include <math.h>
+#include <stdint.h>
+#include <random>
+
+#include "../src/clock_synchronizer.h"
+
+using namespace duo3d_driver;
+
+namespace
+{
+const double FPS = 30.0;
+const double HOST_BASE = 1.7e9;
+const double MIN_LATENCY = 0.005;
+
+// Simulated DUO device: 'drift' is the rate of its clock relative to the
+// host clock minus one, arrivals are delayed by MIN_LATENCY plus an
+// exponentially distributed jitter with mean 'jitter'
+struct Device
+{
+    double drift;
+    uint32_t start_ticks;
+    std::mt19937 rng;
+    std::exponential_distribution<double> jitter;
+
+    Device(double drift, uint32_t start_ticks, double jitter)
+        : drift(drift),
+          start_ticks(start_ticks),
+          rng(1),
+          jitter(1.0 / jitter)
+    {
+    }
+    // Device ticks of frame 'f'
+    uint32_t ticks(int f) const
+    {
+        return start_ticks + (uint32_t)llround(f / FPS * 1e4);
+    }
+    // Host time the frame 'f' was captured at
+    double capture(int f) const
+    {
+        return HOST_BASE + f / FPS / (1 + drift);
+    }
+    double arrival(int f)
+    {
+        return capture(f) + MIN_LATENCY + jitter(rng);
+    }
+};
+}
+
+// One hour with a device clock running 50 ppm fast
+TEST(ClockSynchronizer, drift)
+{
+    ClockSynchronizer sync;
+    sync.configure(300.0, 0.0);
+    Device device(50e-6, 1000, 0.004);
+    double maxError = 0;
+    int frames = (int)(3600 * FPS);
+    for(int f = 0; f < frames; f++)
+    {
+        sync.addFrame(device.ticks(f), device.arrival(f));
+        double error = sync.hostTime(device.ticks(f)) - (device.capture(f) + MIN_LATENCY);
+        if(f > 60 * FPS) maxError = std::max(maxError, fabs(error));
+    }
+    EXPECT_LT(maxError, 1e-4);
+    EXPECT_NEAR(sync.drift(), 50.0, 1.0);
+    EXPECT_EQ(sync.frames(), (uint32_t)frames);
+    EXPECT_GT(sync.latencyMean(), 0.0);
+    EXPECT_GT(sync.latencyJitter(), 0.0);
+}
+
+// The 32-bit device clock wraps around 30 s after the start
+TEST(ClockSynchronizer, wrapAround)
+{
+    ClockSynchronizer sync;
+    sync.configure(300.0, 0.0);
+    Device device(-20e-6, 0xFFFFFFFFu - 30 * 10000, 0.004);
+    double maxError = 0;
+    int frames = (int)(120 * FPS);
+    for(int f = 0; f < frames; f++)
+    {
+        sync.addFrame(device.ticks(f), device.arrival(f));
+        double error = sync.hostTime(device.ticks(f)) - (device.capture(f) + MIN_LATENCY);
+        if(f > 10 * FPS) maxError = std::max(maxError, fabs(error));
+    }
+    EXPECT_LT(device.ticks(frames - 1), device.start_ticks);
+    EXPECT_LT(maxError, 1e-3);
+    EXPECT_EQ(sync.frames(), (uint32_t)frames);
+}
+
+// A prediction error above CLOCK_SYNC_MAX_ERROR restarts the fit
+TEST(ClockSynchronizer, reset)
+{
+    ClockSynchronizer sync;
+    sync.configure(300.0, 0.0);
+    Device device(50e-6, 1000, 0.004);
+    int frames = (int)(60 * FPS);
+    for(int f = 0; f < frames; f++)
+        sync.addFrame(device.ticks(f), device.arrival(f));
+    ASSERT_EQ(sync.frames(), (uint32_t)frames);
+
+    // Device restarted: ticks jump back to zero while the host time goes on
+    double arrival = device.arrival(frames);
+    sync.addFrame(5, arrival);
+    EXPECT_EQ(sync.frames(), 1u);
+    EXPECT_DOUBLE_EQ(sync.hostTime(5), arrival);
+    EXPECT_DOUBLE_EQ(sync.drift(), 0.0);
+    EXPECT_DOUBLE_EQ(sync.latency(), 0.0);
+
+    // Small errors keep the fit
+    sync.addFrame(5 + 333, arrival + 0.0333 + 0.5);
+    EXPECT_EQ(sync.frames(), 2u);
+}
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}